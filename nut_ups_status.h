@@ -0,0 +1,127 @@
+// The parser of the 'ups.status' variable of NUT. It depends on nothing but libc, so that
+// tests/test_nut_ups_status.c can test, fuzz and benchmark it apart from the plugin.
+
+#ifndef UPSD_NUT_UPS_STATUS_H
+#define UPSD_NUT_UPS_STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// https://networkupstools.org/docs/developer-guide.chunked/new-drivers.html#_status_data
+// The bits of the status of a UPS, in the order of the dimensions of the status chart.
+enum nut_ups_status {
+    NUT_UPS_STATUS_OL      = 1 << 0,  // On line
+    NUT_UPS_STATUS_OB      = 1 << 1,  // On battery
+    NUT_UPS_STATUS_LB      = 1 << 2,  // Low battery
+    NUT_UPS_STATUS_HB      = 1 << 3,  // High battery
+    NUT_UPS_STATUS_RB      = 1 << 4,  // The battery needs to be replaced
+    NUT_UPS_STATUS_CHRG    = 1 << 5,  // The battery is charging
+    NUT_UPS_STATUS_DISCHRG = 1 << 6,  // The battery is discharging (inverter is providing load power)
+    NUT_UPS_STATUS_BYPASS  = 1 << 7,  // UPS bypass circuit is active -- no battery protection is available
+    NUT_UPS_STATUS_CAL     = 1 << 8,  // UPS is currently performing runtime calibration (on battery)
+    NUT_UPS_STATUS_OFF     = 1 << 9,  // UPS is offline and is not supplying power to the load
+    NUT_UPS_STATUS_OVER    = 1 << 10, // UPS is overloaded
+    NUT_UPS_STATUS_TRIM    = 1 << 11, // UPS is trimming incoming voltage (called "buck" in some hardware)
+    NUT_UPS_STATUS_BOOST   = 1 << 12, // UPS is boosting incoming voltage
+    NUT_UPS_STATUS_FSD     = 1 << 13, // Forced Shutdown
+    NUT_UPS_STATUS_OTHER   = 1 << 14,
+    NUT_UPS_STATUS_ALARM   = 1 << 15, // UPS has an active alarm (see 'ups.alarm')
+    NUT_UPS_STATUS_TEST    = 1 << 16, // UPS is performing a battery test
+    NUT_UPS_STATUS_ECO     = 1 << 17, // UPS is in ECO (high efficiency) mode
+    NUT_UPS_STATUS_NOCOMM  = 1 << 18, // The driver lost communication with the UPS
+};
+
+// The bit of a token of 'ups.status', or NUT_UPS_STATUS_OTHER for a token which NUT does not
+// document. The tokens are told apart by their first character, and then compared whole. A
+// new token is added to the case of its first character, and to the reference tokens of
+// tests/test_nut_ups_status.c.
+static inline uint32_t nut_ups_status_token(const char *token, size_t len) {
+#define NUT_UPS_STATUS_TOKEN(name, bit)                                  \
+    do {                                                                \
+        if (len == sizeof(name) - 1 && !memcmp(token, name, len))       \
+            return (bit);                                               \
+    } while (0)
+
+    switch (token[0]) {
+        case 'A':
+            NUT_UPS_STATUS_TOKEN("ALARM", NUT_UPS_STATUS_ALARM);
+            break;
+
+        case 'B':
+            NUT_UPS_STATUS_TOKEN("BOOST", NUT_UPS_STATUS_BOOST);
+            NUT_UPS_STATUS_TOKEN("BYPASS", NUT_UPS_STATUS_BYPASS);
+            break;
+
+        case 'C':
+            NUT_UPS_STATUS_TOKEN("CHRG", NUT_UPS_STATUS_CHRG);
+            NUT_UPS_STATUS_TOKEN("CAL", NUT_UPS_STATUS_CAL);
+            NUT_UPS_STATUS_TOKEN("COMM", 0); // the opposite of NOCOMM, so nothing to report
+            break;
+
+        case 'D':
+            NUT_UPS_STATUS_TOKEN("DISCHRG", NUT_UPS_STATUS_DISCHRG);
+            break;
+
+        case 'E':
+            NUT_UPS_STATUS_TOKEN("ECO", NUT_UPS_STATUS_ECO);
+            break;
+
+        case 'F':
+            NUT_UPS_STATUS_TOKEN("FSD", NUT_UPS_STATUS_FSD);
+            break;
+
+        case 'H':
+            NUT_UPS_STATUS_TOKEN("HB", NUT_UPS_STATUS_HB);
+            break;
+
+        case 'L':
+            NUT_UPS_STATUS_TOKEN("LB", NUT_UPS_STATUS_LB);
+            break;
+
+        case 'N':
+            NUT_UPS_STATUS_TOKEN("NOCOMM", NUT_UPS_STATUS_NOCOMM);
+            break;
+
+        case 'O':
+            NUT_UPS_STATUS_TOKEN("OL", NUT_UPS_STATUS_OL);
+            NUT_UPS_STATUS_TOKEN("OB", NUT_UPS_STATUS_OB);
+            NUT_UPS_STATUS_TOKEN("OFF", NUT_UPS_STATUS_OFF);
+            NUT_UPS_STATUS_TOKEN("OVER", NUT_UPS_STATUS_OVER);
+            break;
+
+        case 'R':
+            NUT_UPS_STATUS_TOKEN("RB", NUT_UPS_STATUS_RB);
+            break;
+
+        case 'T':
+            NUT_UPS_STATUS_TOKEN("TRIM", NUT_UPS_STATUS_TRIM);
+            NUT_UPS_STATUS_TOKEN("TEST", NUT_UPS_STATUS_TEST);
+            break;
+    }
+
+#undef NUT_UPS_STATUS_TOKEN
+    return NUT_UPS_STATUS_OTHER;
+}
+
+// Parses the 'ups.status' variable, which is a space-separated list of tokens (e.g. "OL CHRG"),
+// into a bitmask of enum nut_ups_status.
+static inline uint32_t nut_ups_status_parse(const char *s) {
+    uint32_t status = 0;
+
+    while (*s) {
+        while (*s == ' ')
+            s++;
+
+        const char *token = s;
+        while (*s && *s != ' ')
+            s++;
+
+        if (s > token)
+            status |= nut_ups_status_token(token, s - token);
+    }
+
+    return status;
+}
+
+#endif // UPSD_NUT_UPS_STATUS_H
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Benchmarks upsd.plugin against the mock upsd, for a number of UPSes.
+
+For every number of UPSes, the plugin collects the mock upsd for a warmup, so that all of
+the UPSes are registered, and then for the given number of ticks, over which it reports:
+
+    CPU ms/tick         the user and system time of the plugin
+    rw calls/tick       its read(2) and write(2) calls (syscr + syscw of /proc/<pid>/io), i.e.
+                        its writes to netdata: the kernel does not count recv(2) and send(2)
+                        there, which the plugin uses on its connections to upsd
+    peak RSS            the most resident memory of the plugin, since it started
+    stdout bytes/tick   what it wrote for netdata
+
+A tick is a collection of the server, i.e. one 'netdata.upsd_<server>_reconnects' chart.
+
+    benchmark.py ./upsd.plugin --ups 1 100 1000
+"""
+
+import argparse
+import json
+import sys
+import time
+
+from upsd_harness import MockUpsd, Plugin
+
+SERVER = "bench"
+TICK_CHART = "netdata.upsd_%s_reconnects" % SERVER
+
+
+def run(args, ups):
+    mock = MockUpsd("--ups", ups, "--vars", args.vars, "--latency", args.latency, "--script", args.script)
+    plugin = Plugin(args.plugin, "[servers]\n    %s = 127.0.0.1:%d\n" % (SERVER, mock.port))
+
+    try:
+        timeout = args.warmup + args.ticks + 30
+        if not plugin.wait(TICK_CHART, args.warmup, timeout):
+            raise RuntimeError("upsd.plugin did not collect the mock upsd:\n" + plugin.log())
+
+        ticks = plugin.count(TICK_CHART)
+        cpu, calls, _, written = plugin.stats()
+        started = time.monotonic()
+
+        if not plugin.wait(TICK_CHART, ticks + args.ticks, timeout):
+            raise RuntimeError("upsd.plugin stopped collecting the mock upsd:\n" + plugin.log())
+
+        elapsed = time.monotonic() - started
+        ticks = plugin.count(TICK_CHART) - ticks
+        cpu2, calls2, rss, written2 = plugin.stats()
+    finally:
+        plugin.stop()
+        mock.stop()
+
+    return {
+        "ups": ups,
+        "vars": args.vars,
+        "ticks": ticks,
+        "seconds": round(elapsed, 3),
+        "cpu_ms_per_tick": round((cpu2 - cpu) * 1000 / ticks, 3),
+        "rw_calls_per_tick": round((calls2 - calls) / ticks, 1),
+        "peak_rss_bytes": rss,
+        "stdout_bytes_per_tick": round((written2 - written) / ticks, 1),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("plugin", help="the path of upsd.plugin")
+    parser.add_argument("--ups", type=int, nargs="+", default=[1, 100, 1000], help="the numbers of UPSes")
+    parser.add_argument("--vars", type=int, default=50, help="the number of variables of every UPS")
+    parser.add_argument("--latency", type=float, default=0, help="the latency of the mock upsd, in milliseconds")
+    parser.add_argument("--script", default="OL:3600", help="the status transitions of the mock upsd")
+    parser.add_argument("--warmup", type=int, default=5, help="the ticks before measuring")
+    parser.add_argument("--ticks", type=int, default=30, help="the ticks to measure")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    print("%6s %5s %6s %12s %14s %14s %18s" % ("UPSes", "vars", "ticks", "CPU ms/tick", "rw calls/tick", "peak RSS KiB", "stdout bytes/tick"))
+
+    results = []
+    for ups in args.ups:
+        r = run(args, ups)
+        results.append(r)
+        print("%6d %5d %6d %12.3f %14.1f %14d %18.1f" % (r["ups"], r["vars"], r["ticks"], r["cpu_ms_per_tick"],
+                                                         r["rw_calls_per_tick"], r["peak_rss_bytes"] // 1024,
+                                                         r["stdout_bytes_per_tick"]), flush=True)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
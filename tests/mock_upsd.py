@@ -0,0 +1,406 @@
+#!/usr/bin/env python3
+"""A mock upsd, which speaks enough of the NUT network protocol for upsd.plugin.
+
+It simulates any number of UPSes, each with the given number of variables, whose status
+follows a script of transitions (e.g. OL -> OB DISCHRG -> OB DISCHRG LB), with the battery
+charge dropping while they are on battery. The UPSes can also come and go, one every so
+often, like in a long-lived site. So, the plugin can be tested and benchmarked without UPS
+hardware, or a upsd with the dummy-ups driver.
+
+With a certificate, it upgrades connections to TLS on STARTTLS, like upsd with CERTFILE
+set, and resumes their TLS sessions. It can also refuse STARTTLS, or accept it and carry
+on in plaintext, to test how the plugin handles a upsd which does not do what it asked.
+
+It prints 'LISTENING <port>' once it accepts connections, and then one line per event, for
+the tests to follow:
+
+    CONNECT <id>                a connection was accepted
+    DISCONNECT <id>             it was closed
+    STARTTLS ok|refused|plaintext
+                                how STARTTLS was answered
+    TLS new|resumed             the TLS handshake completed, with a new or a resumed session
+    TLS failed <reason>         the TLS handshake failed
+    LIST tls=0|1                the first LIST of a connection, in plaintext or over TLS
+    CHURN -<ups> +<ups>         a UPS was replaced
+
+It reads commands from stdin, one per line:
+
+    drop                        closes every connection, for the plugin to reconnect
+    rotate                      replaces the TLS context, so that no session can be resumed
+    starttls ok|refuse|plaintext
+                                changes how STARTTLS is answered
+    quit                        exits, as does the end of stdin
+
+https://networkupstools.org/docs/developer-guide.chunked/net-protocol.html
+"""
+
+import argparse
+import random
+import socket
+import socketserver
+import ssl
+import sys
+import threading
+import time
+
+# The variables of a real UPS, in the order that upsd lists them. Those which are None are
+# simulated, the others are constant.
+UPS_VARIABLES = [
+    ("battery.charge", None),
+    ("battery.charge.low", "10"),
+    ("battery.runtime", None),
+    ("battery.type", "PbAc"),
+    ("battery.voltage", None),
+    ("battery.voltage.nominal", "24.0"),
+    ("device.mfr", "Mock"),
+    ("device.model", "Mock UPS 1500"),
+    ("device.serial", None),
+    ("device.type", "ups"),
+    ("driver.name", "dummy-ups"),
+    ("driver.version", "2.8.0"),
+    ("input.current", None),
+    ("input.frequency", None),
+    ("input.frequency.nominal", "50"),
+    ("input.realpower", None),
+    ("input.voltage", None),
+    ("input.voltage.nominal", "230"),
+    ("output.current", None),
+    ("output.frequency", None),
+    ("output.voltage", None),
+    ("output.voltage.nominal", "230"),
+    ("ups.beeper.status", "enabled"),
+    ("ups.firmware", "1.0"),
+    ("ups.load", None),
+    ("ups.mfr", "Mock"),
+    ("ups.model", "Mock UPS 1500"),
+    ("ups.realpower", None),
+    ("ups.realpower.nominal", "900"),
+    ("ups.status", None),
+    ("ups.temperature", None),
+]
+
+# How STARTTLS is answered: by upgrading the connection to TLS, by refusing it like a upsd
+# without CERTFILE, or by accepting it but carrying on in plaintext.
+STARTTLS_MODES = ("ok", "refuse", "plaintext")
+
+events_lock = threading.Lock()
+
+
+def event(*words):
+    with events_lock:
+        print(*words, flush=True)
+
+
+def parse_script(script):
+    """Parses 'OL:60,OB DISCHRG:60,OB DISCHRG LB:30' into [(status, seconds), ...]."""
+    steps = []
+    for step in script.split(","):
+        status, _, seconds = step.rpartition(":")
+        steps.append((status.strip(), float(seconds)))
+    return steps
+
+
+class Ups:
+    def __init__(self, name, index, args):
+        self.name = name
+        self.args = args
+        self.offset = index * args.stagger
+        self.charge = 100.0
+        self.updated = time.monotonic()
+        self.serial = "MOCK%06d" % index
+
+        self.variables = list(UPS_VARIABLES[:args.vars])
+        if not any(var == "ups.status" for var, _ in self.variables):
+            self.variables[-1] = ("ups.status", None)
+        for i in range(len(self.variables), args.vars):
+            self.variables.append(("driver.parameter.mock%d" % i, str(i)))
+
+    def status(self, now):
+        steps = self.args.script
+        t = (now - self.args.started + self.offset) % sum(seconds for _, seconds in steps)
+        for status, seconds in steps:
+            if t < seconds:
+                return status
+            t -= seconds
+        return steps[-1][0]
+
+    def values(self):
+        now = time.monotonic()
+        status = self.status(now)
+        on_battery = "OB" in status.split()
+
+        dt = now - self.updated
+        self.updated = now
+        if on_battery:
+            self.charge = max(self.charge - self.args.discharge_rate * dt, 0)
+        else:
+            self.charge = min(self.charge + self.args.discharge_rate / 4 * dt, 100)
+
+        load = 40 + random.uniform(-2, 2)
+        realpower = load / 100 * 900
+        voltage = 0 if on_battery else 230 + random.uniform(-3, 3)
+
+        return {
+            "battery.charge": "%d" % self.charge,
+            "battery.runtime": "%d" % (self.charge * 36),
+            "battery.voltage": "%.1f" % (21.6 + self.charge / 100 * 5.4),
+            "device.serial": self.serial,
+            "input.current": "%.1f" % (0 if on_battery else realpower / 0.92 / voltage),
+            "input.frequency": "%.1f" % (0 if on_battery else 50 + random.uniform(-0.1, 0.1)),
+            "input.realpower": "%d" % (0 if on_battery else realpower / 0.92),
+            "input.voltage": "%.1f" % voltage,
+            "output.current": "%.1f" % (realpower / 230),
+            "output.frequency": "%.1f" % 50,
+            "output.voltage": "%.1f" % (230 + random.uniform(-1, 1)),
+            "ups.load": "%d" % load,
+            "ups.realpower": "%d" % realpower,
+            "ups.status": status,
+            "ups.temperature": "%.1f" % (30 + random.uniform(-0.5, 0.5)),
+        }
+
+    def list_var(self):
+        values = self.values()
+        lines = ["BEGIN LIST VAR %s" % self.name]
+        for name, value in self.variables:
+            lines.append('VAR %s %s "%s"' % (self.name, name, value if value is not None else values[name]))
+        lines.append("END LIST VAR %s" % self.name)
+        return "\n".join(lines) + "\n"
+
+
+class Upsd:
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.ups = {}
+        self.connections = set()
+        self.connected = 0
+        self.added = 0
+        self.starttls = args.starttls
+        self.tls_context = self.new_tls_context()
+        for _ in range(args.ups):
+            self.add()
+
+    def add(self):
+        with self.lock:
+            self.added += 1
+            name = "ups%d" % self.added
+            self.ups[name] = Ups(name, self.added, self.args)
+        return name
+
+    def new_tls_context(self):
+        """A TLS context has keys of its own for the tickets of its sessions, so the sessions of
+        a previous context cannot be resumed."""
+        if not self.args.certfile:
+            return None
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(self.args.certfile, self.args.keyfile)
+        return context
+
+    def churn(self):
+        """Replaces the oldest UPS with a new one, every --churn seconds."""
+        while True:
+            time.sleep(self.args.churn)
+            with self.lock:
+                removed = next(iter(self.ups), None)
+                if removed:
+                    del self.ups[removed]
+            event("CHURN", "-%s" % removed, "+%s" % self.add())
+
+    def list_ups(self):
+        with self.lock:
+            names = list(self.ups)
+        lines = ["BEGIN LIST UPS"] + ['UPS %s "Mock UPS %s"' % (name, name) for name in names] + ["END LIST UPS"]
+        return "\n".join(lines) + "\n"
+
+    def list_var(self, name):
+        with self.lock:
+            ups = self.ups.get(name)
+        return ups.list_var() if ups else "ERR UNKNOWN-UPS\n"
+
+    def drop(self):
+        with self.lock:
+            connections = list(self.connections)
+        for handler in connections:
+            try:
+                handler.sock.shutdown(socket.SHUT_RDWR)
+            except (OSError, ValueError):
+                pass
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def setup(self):
+        upsd = self.server.upsd
+        self.sock = self.request
+        self.tls = False
+        self.listed = False
+        with upsd.lock:
+            upsd.connected += 1
+            self.id = upsd.connected
+            upsd.connections.add(self)
+        event("CONNECT", self.id)
+
+    def finish(self):
+        upsd = self.server.upsd
+        with upsd.lock:
+            upsd.connections.discard(self)
+        event("DISCONNECT", self.id)
+
+    def respond(self, line):
+        upsd = self.server.upsd
+        words = line.split()
+
+        if len(words) >= 2 and words[0] == "LIST":
+            if not self.listed:
+                self.listed = True
+                event("LIST", "tls=%d" % self.tls)
+            if words[1] == "UPS" and len(words) == 2:
+                return upsd.list_ups()
+            if words[1] == "VAR" and len(words) == 3:
+                return upsd.list_var(words[2])
+            return "ERR INVALID-ARGUMENT\n"
+
+        if words and words[0] == "VER":
+            return "Network UPS Tools upsd 2.8.0 - mock\n"
+
+        if words and words[0] in ("USERNAME", "PASSWORD"):
+            return "OK\n"
+
+        if words and words[0] == "LOGOUT":
+            return None
+
+        return "ERR UNKNOWN-COMMAND\n"
+
+    def starttls(self):
+        """Answers STARTTLS like upsd does, and upgrades the connection to TLS if it should.
+        Returns False if the connection is over."""
+        upsd = self.server.upsd
+        with upsd.lock:
+            mode, context = upsd.starttls, upsd.tls_context
+
+        if self.tls or not context or mode == "refuse":
+            event("STARTTLS", "refused")
+            self.sock.sendall(b"ERR FEATURE-NOT-CONFIGURED\n")
+            return True
+
+        self.sock.sendall(b"OK STARTTLS\n")
+        if mode == "plaintext":
+            event("STARTTLS", "plaintext")
+            return True
+        event("STARTTLS", "ok")
+
+        try:
+            sock = context.wrap_socket(self.sock, server_side=True)
+        except (OSError, ssl.SSLError) as e:
+            event("TLS", "failed", getattr(e, "reason", None) or e.__class__.__name__)
+            return False
+
+        with upsd.lock:
+            self.sock = sock
+        self.tls = True
+        event("TLS", "resumed" if sock.session_reused else "new")
+        return True
+
+    def handle(self):
+        pending = b""
+
+        while True:
+            try:
+                data = self.sock.recv(65536)
+            except (OSError, ValueError):
+                return
+            if not data:
+                return
+
+            # The responses to what was read at once are delayed once, like by the round
+            # trip of a network, however many queries were pipelined.
+            if self.server.upsd.args.latency:
+                time.sleep(self.server.upsd.args.latency / 1000)
+
+            pending += data
+            *lines, pending = pending.split(b"\n")
+            responses = []
+            for line in lines:
+                line = line.decode("utf-8", "replace").strip()
+
+                # The handshake follows the response, so the responses before it go first.
+                if line == "STARTTLS":
+                    try:
+                        self.sock.sendall("".join(responses).encode())
+                    except OSError:
+                        return
+                    responses = []
+                    if not self.starttls():
+                        return
+                    continue
+
+                response = self.respond(line)
+                if response is None:
+                    self.sock.sendall("".join(responses).encode() + b"OK Goodbye\n")
+                    return
+                responses.append(response)
+
+            try:
+                self.sock.sendall("".join(responses).encode())
+            except OSError:
+                return
+
+
+class Server(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def commands(upsd, server):
+    for line in sys.stdin:
+        words = line.split()
+        if not words:
+            continue
+        if words[0] == "drop":
+            upsd.drop()
+        elif words[0] == "rotate":
+            context = upsd.new_tls_context()
+            with upsd.lock:
+                upsd.tls_context = context
+        elif words[0] == "starttls" and len(words) == 2 and words[1] in STARTTLS_MODES:
+            with upsd.lock:
+                upsd.starttls = words[1]
+        elif words[0] == "quit":
+            break
+        else:
+            event("ERROR unknown command", words[0])
+    server.shutdown()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=0, help="0 picks a free port")
+    parser.add_argument("--ups", type=int, default=1, help="the number of UPSes")
+    parser.add_argument("--vars", type=int, default=len(UPS_VARIABLES), help="the number of variables of every UPS")
+    parser.add_argument("--latency", type=float, default=0, help="milliseconds to wait before answering what was read")
+    parser.add_argument("--script", type=parse_script, default=parse_script("OL:3600"),
+                        help="the status transitions, as <status>:<seconds>,... repeated (e.g. 'OL:60,OB DISCHRG:60,OB DISCHRG LB:30')")
+    parser.add_argument("--stagger", type=float, default=0, help="seconds between the scripts of consecutive UPSes")
+    parser.add_argument("--discharge-rate", type=float, default=1 / 30, help="battery percents per second on battery")
+    parser.add_argument("--churn", type=float, default=0, help="seconds between replacing the oldest UPS with a new one")
+    parser.add_argument("--certfile", help="the certificate of upsd, in PEM, for STARTTLS")
+    parser.add_argument("--keyfile", help="its private key, in PEM")
+    parser.add_argument("--starttls", choices=STARTTLS_MODES, default="ok", help="how STARTTLS is answered, given a certificate")
+    args = parser.parse_args()
+    args.started = time.monotonic()
+
+    upsd = Upsd(args)
+    server = Server((args.host, args.port), Handler)
+    server.upsd = upsd
+
+    threading.Thread(target=commands, args=(upsd, server), daemon=True).start()
+    if args.churn:
+        threading.Thread(target=upsd.churn, daemon=True).start()
+
+    event("LISTENING", server.server_address[1])
+    server.serve_forever()
+    server.server_close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Tests that the memory of upsd.plugin stays bounded while UPSes come and go.
+
+The mock upsd replaces its oldest UPS with a new one every second, so that over the test
+every UPS is removed and added a few times over. The plugin has to register the new UPSes,
+mark the charts of the removed ones obsolete, and free them, so that the memory which it
+charts in 'netdata.upsd_<server>_memory' (its ARAL of UPSes, its buffers and its index of
+UPSes) stops growing once it has seen as many UPSes at once as it ever will. So does its
+resident memory, both as the plugin charts it in 'netdata.upsd_rss' and as /proc says, but
+for what the allocator keeps of the pages it was given, within RSS_SLACK.
+
+    test_churn.py ./upsd.plugin
+"""
+
+import argparse
+import sys
+
+from upsd_harness import MockUpsd, Plugin
+
+SERVER = "churn"
+MEMORY_CHART = "netdata.upsd_%s_memory" % SERVER
+TICK_CHART = "netdata.upsd_%s_reconnects" % SERVER
+RSS_CHART = "netdata.upsd_rss"
+RSS_SLACK = 256 * 1024
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("plugin", help="the path of upsd.plugin")
+    parser.add_argument("--ups", type=int, default=10, help="the number of UPSes at once")
+    parser.add_argument("--ticks", type=int, default=60, help="the ticks to run for, after the warmup")
+    parser.add_argument("--warmup", type=int, default=15, help="the ticks before the memory has to be flat")
+    args = parser.parse_args()
+
+    mock = MockUpsd("--ups", args.ups, "--churn", 1, "--script", "OL:10,OB DISCHRG:10")
+    plugin = Plugin(args.plugin, "[global]\n    self telemetry = yes\n[servers]\n    %s = 127.0.0.1:%d\n" % (SERVER, mock.port))
+    plugin.follow(MEMORY_CHART)
+    plugin.follow(RSS_CHART)
+
+    rss = []
+    try:
+        ok = True
+        for tick in range(1, args.warmup + args.ticks + 1):
+            ok = plugin.wait(TICK_CHART, tick, 30)
+            if not ok:
+                break
+            if tick > args.warmup:
+                rss.append(plugin.rss())
+        log = plugin.log()
+        events = mock.drain()
+    finally:
+        plugin.stop()
+        mock.stop()
+
+    if not ok:
+        print("FAIL: upsd.plugin stopped collecting the mock upsd:\n" + log)
+        return 1
+
+    failures = []
+
+    # Every UPS which the mock removed has its charts marked obsolete, and every one which it
+    # added is collected, except for the most recent few. The first UPSes may be removed before
+    # the plugin lists them, and then they have no charts to mark.
+    removed = [e.split()[1][1:] for e in events if e.startswith("CHURN")]
+    added = [e.split()[2][1:] for e in events if e.startswith("CHURN")]
+    if len(removed) < args.ups * 3:
+        failures.append("the mock upsd replaced %d UPSes, fewer than %d" % (len(removed), args.ups * 3))
+    for ups in removed[:-3]:
+        chart = "upsd_%s_%s.status" % (SERVER, ups)
+        if chart in plugin.charts and chart not in plugin.obsolete:
+            failures.append("the charts of the removed UPS %s are not obsolete" % ups)
+    for ups in added[:-3]:
+        if not plugin.count("upsd_%s_%s.status" % (SERVER, ups)):
+            failures.append("the added UPS %s was not collected" % ups)
+
+    # Past the warmup, none of the memory goes beyond what it was in the first half.
+    samples = plugin.history[MEMORY_CHART][args.warmup:]
+    half = len(samples) // 2
+    for name, dimensions in (("ARAL", ("ups", "ups_free")), ("buffers", ("buffers",)), ("index", ("index",))):
+        sizes = [sum(int(s.get(d, 0)) for d in dimensions) for s in samples]
+        print("%-9s %s" % (name, " ".join(map(str, sizes))))
+        if max(sizes[half:]) > max(sizes[:half]):
+            failures.append("the %s memory grew from %d to %d bytes" % (name, max(sizes[:half]), max(sizes[half:])))
+
+    # Neither does the resident memory of the plugin, but for some slack.
+    for name, sizes in (("chart RSS", [int(s.get("rss", 0)) for s in plugin.history[RSS_CHART][args.warmup:]]),
+                        ("proc RSS", rss)):
+        half = len(sizes) // 2
+        print("%-9s %s" % (name, " ".join(map(str, sizes))))
+        if half == 0 or not all(sizes):
+            failures.append("the %s of the plugin was not sampled" % name)
+        elif max(sizes[half:]) > max(sizes[:half]) + RSS_SLACK:
+            failures.append("the %s of the plugin grew from %d to %d bytes" % (name, max(sizes[:half]), max(sizes[half:])))
+
+    for failure in failures:
+        print("FAIL:", failure)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,275 @@
+// Tests the parser of 'ups.status' against a plain linear one, which it replaced, on the
+// tokens of NUT, on unknown tokens, and on random status strings.
+//
+//   test_nut_ups_status            runs the tests
+//   test_nut_ups_status --bench    also times both parsers on real status strings
+//
+// Built with -DNUT_UPS_STATUS_FUZZER and -fsanitize=fuzzer, it is a libFuzzer target which
+// checks the same on any input instead.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nut_ups_status.h"
+
+// The tokens of 'ups.status' and their bits, as NUT documents them, written out apart
+// from the parser, so that a token which is missing from it shows.
+static const struct {
+    const char *token;
+    uint32_t status;
+} reference_tokens[] = {
+    { "OL",      NUT_UPS_STATUS_OL      },
+    { "OB",      NUT_UPS_STATUS_OB      },
+    { "LB",      NUT_UPS_STATUS_LB      },
+    { "HB",      NUT_UPS_STATUS_HB      },
+    { "RB",      NUT_UPS_STATUS_RB      },
+    { "CHRG",    NUT_UPS_STATUS_CHRG    },
+    { "DISCHRG", NUT_UPS_STATUS_DISCHRG },
+    { "BYPASS",  NUT_UPS_STATUS_BYPASS  },
+    { "CAL",     NUT_UPS_STATUS_CAL     },
+    { "OFF",     NUT_UPS_STATUS_OFF     },
+    { "OVER",    NUT_UPS_STATUS_OVER    },
+    { "TRIM",    NUT_UPS_STATUS_TRIM    },
+    { "BOOST",   NUT_UPS_STATUS_BOOST   },
+    { "FSD",     NUT_UPS_STATUS_FSD     },
+    { "ALARM",   NUT_UPS_STATUS_ALARM   },
+    { "TEST",    NUT_UPS_STATUS_TEST    },
+    { "ECO",     NUT_UPS_STATUS_ECO     },
+    { "NOCOMM",  NUT_UPS_STATUS_NOCOMM  },
+    { "COMM",    0                      },
+};
+
+#define REFERENCE_TOKENS (sizeof(reference_tokens) / sizeof(reference_tokens[0]))
+
+// Status strings which NUT drivers report.
+static const struct {
+    const char *status_string;
+    uint32_t status;
+} real_statuses[] = {
+    { "OL",                 NUT_UPS_STATUS_OL },
+    { "OL CHRG",            NUT_UPS_STATUS_OL | NUT_UPS_STATUS_CHRG },
+    { "OB DISCHRG",         NUT_UPS_STATUS_OB | NUT_UPS_STATUS_DISCHRG },
+    { "OB DISCHRG LB",      NUT_UPS_STATUS_OB | NUT_UPS_STATUS_DISCHRG | NUT_UPS_STATUS_LB },
+    { "OB LB FSD",          NUT_UPS_STATUS_OB | NUT_UPS_STATUS_LB | NUT_UPS_STATUS_FSD },
+    { "OL CHRG LB",         NUT_UPS_STATUS_OL | NUT_UPS_STATUS_CHRG | NUT_UPS_STATUS_LB },
+    { "OL BOOST",           NUT_UPS_STATUS_OL | NUT_UPS_STATUS_BOOST },
+    { "OL TRIM",            NUT_UPS_STATUS_OL | NUT_UPS_STATUS_TRIM },
+    { "OL RB",              NUT_UPS_STATUS_OL | NUT_UPS_STATUS_RB },
+    { "OL BYPASS",          NUT_UPS_STATUS_OL | NUT_UPS_STATUS_BYPASS },
+    { "OB CAL",             NUT_UPS_STATUS_OB | NUT_UPS_STATUS_CAL },
+    { "OL OVER",            NUT_UPS_STATUS_OL | NUT_UPS_STATUS_OVER },
+    { "OL HB",              NUT_UPS_STATUS_OL | NUT_UPS_STATUS_HB },
+    { "OFF",                NUT_UPS_STATUS_OFF },
+    { "OL ALARM",           NUT_UPS_STATUS_OL | NUT_UPS_STATUS_ALARM },
+    { "OL TEST",            NUT_UPS_STATUS_OL | NUT_UPS_STATUS_TEST },
+    { "OL ECO",             NUT_UPS_STATUS_OL | NUT_UPS_STATUS_ECO },
+    { "OL NOCOMM",          NUT_UPS_STATUS_OL | NUT_UPS_STATUS_NOCOMM },
+    { "OL COMM",            NUT_UPS_STATUS_OL },
+    { "OL CHRG WAIT",       NUT_UPS_STATUS_OL | NUT_UPS_STATUS_CHRG | NUT_UPS_STATUS_OTHER },
+    { "",                   0 },
+    { "  OL   CHRG  ",      NUT_UPS_STATUS_OL | NUT_UPS_STATUS_CHRG },
+};
+
+#define REAL_STATUSES (sizeof(real_statuses) / sizeof(real_statuses[0]))
+
+// The way 'ups.status' was parsed before: token by token, comparing each
+// one with every token of NUT.
+static uint32_t reference_parse(const char *s) {
+    uint32_t status = 0;
+
+    while (*s) {
+        while (*s == ' ')
+            s++;
+
+        const char *token = s;
+        while (*s && *s != ' ')
+            s++;
+
+        size_t len = s - token;
+        if (!len)
+            continue;
+
+        uint32_t bit = NUT_UPS_STATUS_OTHER;
+        for (size_t i = 0; i < REFERENCE_TOKENS; i++) {
+            if (strlen(reference_tokens[i].token) == len && !memcmp(reference_tokens[i].token, token, len)) {
+                bit = reference_tokens[i].status;
+                break;
+            }
+        }
+        status |= bit;
+    }
+
+    return status;
+}
+
+#ifdef NUT_UPS_STATUS_FUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char s[size + 1];
+
+    // 'ups.status' is a string, so it ends at the first NUL.
+    memcpy(s, data, size);
+    s[size] = '\0';
+
+    if (nut_ups_status_parse(s) != reference_parse(s))
+        abort();
+
+    return 0;
+}
+
+#else // NUT_UPS_STATUS_FUZZER
+
+static size_t failures = 0;
+
+#define check(cond, fmt, ...)                                   \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            fprintf(stderr, "FAIL: " fmt "\n", ##__VA_ARGS__);  \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+// Every token of NUT maps to its bit. That the parser has no token that NUT does not is
+// checked by the unknown tokens, and by the random status strings.
+static void test_tokens(void) {
+    for (size_t i = 0; i < REFERENCE_TOKENS; i++) {
+        const char *token = reference_tokens[i].token;
+        uint32_t status = nut_ups_status_token(token, strlen(token));
+        check(status == reference_tokens[i].status, "token '%s' maps to 0x%x instead of 0x%x", token, status, reference_tokens[i].status);
+
+        status = nut_ups_status_parse(token);
+        check(status == reference_tokens[i].status, "'%s' parses to 0x%x instead of 0x%x", token, status, reference_tokens[i].status);
+    }
+}
+
+// Unknown tokens, including every uppercase one of up to 3 letters, and tokens which are a
+// prefix, a suffix or a different case of a known one, fall back to OTHER.
+static void test_unknown_tokens(void) {
+    static const char *unknown[] = {
+        "O", "L", "OLL", "OL2", "ol", "Ol", "oL", "OB_", "NOCOM", "OMM", "COMMS", "NOCOMMS", "CHRGX",
+        "DISCHARGE", "DISCHRGG", "BOOS", "BOOSTT", "BYPAS", "ALARMS", "TESTING", "ECOO", "WAIT",
+        "FSDX", "OFFLINE", "\tOL", "OL\t", "OL\n", "\xff", "\xffOL", "O\xff",
+    };
+
+    for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        uint32_t status = nut_ups_status_parse(unknown[i]);
+        check(status == NUT_UPS_STATUS_OTHER, "unknown token '%s' parses to 0x%x instead of OTHER", unknown[i], status);
+    }
+
+    char token[4];
+    for (size_t len = 1; len <= 3; len++) {
+        size_t combinations = 1;
+        for (size_t i = 0; i < len; i++)
+            combinations *= 26;
+
+        for (size_t n = 0; n < combinations; n++) {
+            size_t x = n;
+            for (size_t i = 0; i < len; i++, x /= 26)
+                token[i] = 'A' + x % 26;
+            token[len] = '\0';
+
+            uint32_t status = nut_ups_status_parse(token);
+            uint32_t expected = reference_parse(token);
+            check(status == expected, "'%s' parses to 0x%x instead of 0x%x", token, status, expected);
+        }
+    }
+}
+
+static void test_real_statuses(void) {
+    for (size_t i = 0; i < REAL_STATUSES; i++) {
+        uint32_t status = nut_ups_status_parse(real_statuses[i].status_string);
+        check(status == real_statuses[i].status, "'%s' parses to 0x%x instead of 0x%x",
+              real_statuses[i].status_string, status, real_statuses[i].status);
+    }
+}
+
+// Random strings of tokens, mutated tokens and spaces parse like the reference does.
+static void test_random_statuses(void) {
+    static const char noise[] = "ABCDEFHILMNORSTVYabc\t\xff";
+    char s[256];
+
+    srand(1);
+    for (size_t n = 0; n < 200000; n++) {
+        size_t len = 0;
+        size_t tokens = rand() % 6;
+
+        while (len < 16 && rand() % 4 == 0)
+            s[len++] = ' ';
+
+        for (size_t t = 0; t < tokens; t++) {
+            if (rand() % 3) {
+                const char *token = reference_tokens[rand() % REFERENCE_TOKENS].token;
+                size_t token_len = strlen(token);
+
+                // Sometimes cut it short, or extend it.
+                if (rand() % 8 == 0)
+                    token_len = rand() % token_len + 1;
+                memcpy(s + len, token, token_len);
+                len += token_len;
+                if (rand() % 8 == 0)
+                    s[len++] = noise[rand() % (sizeof(noise) - 1)];
+            }
+            else {
+                size_t token_len = rand() % 8 + 1;
+                for (size_t i = 0; i < token_len; i++)
+                    s[len++] = noise[rand() % (sizeof(noise) - 1)];
+            }
+
+            do
+                s[len++] = ' ';
+            while (rand() % 4 == 0 && len < (t + 1) * 32);
+        }
+        s[len] = '\0';
+
+        uint32_t status = nut_ups_status_parse(s);
+        uint32_t expected = reference_parse(s);
+        check(status == expected, "'%s' parses to 0x%x instead of 0x%x", s, status, expected);
+        if (failures > 10)
+            return;
+    }
+}
+
+static double bench(uint32_t (*parse)(const char *), size_t rounds) {
+    struct timespec started, ended;
+    volatile uint32_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < REAL_STATUSES; i++)
+            sink += parse(real_statuses[i].status_string);
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+
+    (void)sink;
+    double ns = (ended.tv_sec - started.tv_sec) * 1e9 + (ended.tv_nsec - started.tv_nsec);
+    return ns / (rounds * REAL_STATUSES);
+}
+
+static uint32_t switch_parse(const char *s) {
+    return nut_ups_status_parse(s);
+}
+
+int main(int argc, char *argv[]) {
+    test_tokens();
+    test_unknown_tokens();
+    test_real_statuses();
+    test_random_statuses();
+
+    if (failures) {
+        fprintf(stderr, "%zu checks failed\n", failures);
+        return 1;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "--bench")) {
+        size_t rounds = 1000000;
+        printf("ups.status parser: %.1f ns/status with the switch, %.1f ns/status with the linear scan\n",
+               bench(switch_parse, rounds), bench(reference_parse, rounds));
+    }
+
+    return 0;
+}
+
+#endif // NUT_UPS_STATUS_FUZZER
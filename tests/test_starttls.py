@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+"""Tests STARTTLS, TLS session resumption and keepalive against the mock upsd over TLS.
+
+It makes a CA and a certificate for 127.0.0.1 with the openssl command, and checks that:
+
+    resume      the plugin collects over TLS only, resumes its session when it reconnects,
+                and falls back to a full handshake when upsd no longer has the session;
+                its connection is kept alive by TCP keepalive
+    refuse      when upsd refuses STARTTLS, the plugin retries rather than collecting in
+                plaintext, and collects over TLS once upsd accepts it
+    plaintext   when upsd accepts STARTTLS but carries on in plaintext, the handshake fails
+                within the timeout of the plugin, and the plugin reconnects
+    wrong-ca    a certificate that the configured CAs did not issue is rejected
+
+    test_starttls.py ./upsd.plugin [case ...]
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from upsd_harness import MockUpsd, Plugin
+
+SERVER = "tls"
+UPS_CHART = "upsd_%s_ups1.status" % SERVER
+KEEPALIVE_SEC = 30
+
+# The timeout of the plugin for the handshake (NUT_CLIENT_TIMEOUT_SEC), and the longest
+# delay of its first reconnections.
+HANDSHAKE_TIMEOUT_SEC = 10
+RECONNECT_SEC = 8
+
+
+def openssl(*args):
+    subprocess.run(["openssl", *args], check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def make_certificates(directory):
+    """Makes two CAs, and a certificate for 127.0.0.1 which the first one issued."""
+    for ca in ("ca", "other-ca"):
+        openssl("req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1", "-subj", "/CN=upsd test %s" % ca,
+                "-addext", "basicConstraints=critical,CA:TRUE", "-addext", "keyUsage=critical,keyCertSign",
+                "-keyout", os.path.join(directory, ca + ".key"), "-out", os.path.join(directory, ca + ".pem"))
+
+    ext = os.path.join(directory, "server.ext")
+    with open(ext, "w") as f:
+        f.write("subjectAltName = IP:127.0.0.1\nbasicConstraints = CA:FALSE\n")
+
+    openssl("req", "-newkey", "rsa:2048", "-nodes", "-subj", "/CN=127.0.0.1",
+            "-keyout", os.path.join(directory, "server.key"), "-out", os.path.join(directory, "server.csr"))
+    openssl("x509", "-req", "-days", "1", "-in", os.path.join(directory, "server.csr"), "-extfile", ext,
+            "-CA", os.path.join(directory, "ca.pem"), "-CAkey", os.path.join(directory, "ca.key"),
+            "-CAcreateserial", "-out", os.path.join(directory, "server.pem"))
+
+
+class Case:
+    def __init__(self, args, certs, ca="ca", starttls="ok"):
+        self.mock = MockUpsd("--ups", 2, "--starttls", starttls,
+                             "--certfile", os.path.join(certs, "server.pem"),
+                             "--keyfile", os.path.join(certs, "server.key"))
+        self.plugin = Plugin(args.plugin, "[global]\n"
+                                          "    starttls = yes\n"
+                                          "    tls ca file = %s\n"
+                                          "    keepalive every = %ds\n"
+                                          "[servers]\n"
+                                          "    %s = 127.0.0.1:%d\n"
+                             % (os.path.join(certs, ca + ".pem"), KEEPALIVE_SEC, SERVER, self.mock.port))
+        self.failures = []
+
+    def expect(self, prefix, timeout, what):
+        line = self.mock.wait_event(prefix, timeout)
+        if not line:
+            self.failures.append("%s: no '%s' within %d seconds" % (what, prefix, timeout))
+        return line
+
+    def expect_none(self, prefix, seconds, what):
+        deadline = time.monotonic() + seconds
+        while time.monotonic() < deadline:
+            self.mock.wait_event("\0", deadline - time.monotonic())
+        for line in self.mock.history:
+            if line.startswith(prefix):
+                self.failures.append("%s: '%s'" % (what, line))
+                break
+
+    def stop(self):
+        log = self.plugin.log()
+        self.plugin.stop()
+        self.mock.stop()
+        plaintext = [line for line in self.mock.history + self.mock.drain() if line == "LIST tls=0"]
+        if plaintext:
+            self.failures.append("upsd was queried in plaintext")
+        if self.failures:
+            self.failures.append("the events of the mock upsd: %s\nthe log of the plugin:\n%s" % (self.mock.history, log))
+        return self.failures
+
+
+def keepalive_timers(port):
+    """The timers of the connections to port in /proc/net/tcp, as (timer, seconds) pairs."""
+    timers = []
+    for path in ("/proc/net/tcp", "/proc/net/tcp6"):
+        try:
+            with open(path) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if int(fields[2].rpartition(":")[2], 16) == port:
+                        timer, _, when = fields[5].partition(":")
+                        timers.append((int(timer, 16), int(when, 16) / 100))
+        except FileNotFoundError:
+            pass
+    return timers
+
+
+def test_resume(args, certs):
+    case = Case(args, certs)
+    case.expect("TLS new", RECONNECT_SEC, "the first connection")
+    case.expect("LIST tls=1", RECONNECT_SEC, "the first connection")
+    if not case.plugin.wait(UPS_CHART, 1, RECONNECT_SEC):
+        case.failures.append("the UPSes were not collected over TLS")
+
+    # Between ticks, the connection is idle, so the keepalive timer of the kernel is armed
+    # (timer 2 of /proc/net/tcp), within the configured interval.
+    timers = []
+    for _ in range(10):
+        timers = keepalive_timers(case.mock.port)
+        if any(timer == 2 and when <= KEEPALIVE_SEC for timer, when in timers):
+            break
+        time.sleep(0.3)
+    else:
+        case.failures.append("the connection to upsd has no keepalive timer of up to %ds: %s" % (KEEPALIVE_SEC, timers))
+
+    case.mock.command("drop")
+    case.expect("TLS resumed", RECONNECT_SEC, "the reconnection")
+    case.expect("LIST tls=1", RECONNECT_SEC, "the reconnection")
+
+    # A stale session costs a full handshake, not the connection.
+    case.mock.command("rotate")
+    case.mock.command("drop")
+    case.expect("TLS new", RECONNECT_SEC, "the reconnection with a stale session")
+    case.expect("LIST tls=1", RECONNECT_SEC, "the reconnection with a stale session")
+
+    ticks = case.plugin.count(UPS_CHART)
+    if not case.plugin.wait(UPS_CHART, ticks + 2, RECONNECT_SEC):
+        case.failures.append("the UPSes were not collected after the reconnections")
+    return case.stop()
+
+
+def test_refuse(args, certs):
+    case = Case(args, certs, starttls="refuse")
+    case.expect("STARTTLS refused", RECONNECT_SEC, "the first connection")
+    case.expect("STARTTLS refused", RECONNECT_SEC, "the retry")
+    case.expect_none("LIST", 1, "upsd was queried although it refused STARTTLS")
+
+    case.mock.command("starttls ok")
+    case.expect("TLS new", 3 * RECONNECT_SEC, "the connection once upsd accepts STARTTLS")
+    case.expect("LIST tls=1", RECONNECT_SEC, "the connection once upsd accepts STARTTLS")
+    return case.stop()
+
+
+def test_plaintext(args, certs):
+    case = Case(args, certs, starttls="plaintext")
+    case.expect("STARTTLS plaintext", RECONNECT_SEC, "the first connection")
+    case.expect("DISCONNECT 1", HANDSHAKE_TIMEOUT_SEC + 5, "the failed handshake")
+    case.expect("CONNECT 2", RECONNECT_SEC, "the reconnection after the failed handshake")
+    case.expect_none("LIST", 1, "upsd was queried without TLS")
+    return case.stop()
+
+
+def test_wrong_ca(args, certs):
+    case = Case(args, certs, ca="other-ca")
+    case.expect("TLS failed", RECONNECT_SEC, "the handshake with an untrusted certificate")
+    case.expect("TLS failed", RECONNECT_SEC, "the retry with an untrusted certificate")
+    case.expect_none("LIST", 1, "upsd was queried with an untrusted certificate")
+    return case.stop()
+
+
+CASES = {
+    "resume": test_resume,
+    "refuse": test_refuse,
+    "plaintext": test_plaintext,
+    "wrong-ca": test_wrong_ca,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("plugin", help="the path of upsd.plugin")
+    parser.add_argument("cases", nargs="*", help="the cases to run, of %s (all by default)" % ", ".join(CASES))
+    args = parser.parse_args()
+    for name in args.cases:
+        if name not in CASES:
+            parser.error("unknown case: %s" % name)
+
+    failed = 0
+    with tempfile.TemporaryDirectory(prefix="upsd-tls-") as certs:
+        make_certificates(certs)
+        for name in args.cases or CASES:
+            failures = CASES[name](args, certs)
+            print("%s: %s" % (name, "FAIL" if failures else "ok"), flush=True)
+            for failure in failures:
+                print("    " + failure)
+            failed += bool(failures)
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,214 @@
+"""Runs upsd.plugin against the mock upsd, for the tests and the benchmark.
+
+The plugin is run the way netdata runs it: with upsd.conf in NETDATA_USER_CONFIG_DIR, its
+stdin kept open, and its stdout parsed as it is written. The mock upsd is tests/mock_upsd.py.
+"""
+
+import os
+import queue
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MOCK_UPSD = os.path.join(os.path.dirname(os.path.abspath(__file__)), "mock_upsd.py")
+
+BEGIN_RE = re.compile(r"^BEGIN (?:SLOT:\S+ )?'?([^' ]+)'?")
+SET_RE = re.compile(r"^SET (?:SLOT:\S+ )?'?([^' ]+)'? = (\S+)")
+CHART_RE = re.compile(r"^CHART (?:SLOT:\S+ )?'([^']+)'")
+
+
+class MockUpsd:
+    """The mock upsd, with the events that it prints, e.g. 'CONNECT 1'."""
+
+    def __init__(self, *args):
+        self.proc = subprocess.Popen([sys.executable, MOCK_UPSD, *map(str, args)],
+                                     stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True, bufsize=1)
+        self.events = queue.Queue()
+        self.history = []
+
+        line = self.proc.stdout.readline().split()
+        if not line or line[0] != "LISTENING":
+            self.stop()
+            raise RuntimeError("the mock upsd did not start: %s" % line)
+        self.port = int(line[1])
+
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read(self):
+        for line in self.proc.stdout:
+            self.events.put(line.strip())
+
+    def command(self, line):
+        self.proc.stdin.write(line + "\n")
+        self.proc.stdin.flush()
+
+    def wait_event(self, prefix, timeout):
+        """Returns the first event since the last call which starts with prefix, or None."""
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                line = self.events.get(timeout=max(deadline - time.monotonic(), 0))
+            except queue.Empty:
+                return None
+            self.history.append(line)
+            if line.startswith(prefix):
+                return line
+
+    def drain(self):
+        """Returns the events since the last call."""
+        lines = []
+        while True:
+            try:
+                lines.append(self.events.get_nowait())
+            except queue.Empty:
+                self.history += lines
+                return lines
+
+    def stop(self):
+        try:
+            self.proc.stdin.close()
+        except OSError:
+            pass
+        try:
+            self.proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+
+
+class Plugin:
+    """upsd.plugin, with upsd.conf given as text, and what it has written so far."""
+
+    def __init__(self, plugin, config, update_every=1):
+        self.dir = tempfile.TemporaryDirectory(prefix="upsd-plugin-")
+        with open(os.path.join(self.dir.name, "upsd.conf"), "w") as f:
+            f.write(config)
+
+        env = dict(os.environ,
+                   NETDATA_USER_CONFIG_DIR=self.dir.name,
+                   NETDATA_STOCK_CONFIG_DIR=self.dir.name,
+                   NETDATA_LOG_LEVEL="debug")
+        self.stderr = open(os.path.join(self.dir.name, "stderr.log"), "w+")
+        self.proc = subprocess.Popen([plugin, str(update_every)], env=env,
+                                     stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=self.stderr)
+
+        self.lock = threading.Condition()
+        self.bytes = 0
+        self.ticks = {}         # the number of BEGIN lines of every chart
+        self.charts = set()     # the charts defined with CHART
+        self.obsolete = set()   # the charts marked obsolete
+        self.values = {}        # the most recent SET of every dimension, by chart
+        self.history = {}       # every SET of the charts which are followed, by chart
+
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def follow(self, chart):
+        """Keeps every set of values of chart, as of the next time that it is sent."""
+        with self.lock:
+            self.history.setdefault(chart, [])
+
+    def _read(self):
+        chart = None
+        for line in self.proc.stdout:
+            with self.lock:
+                self.bytes += len(line)
+                line = line.decode("utf-8", "replace")
+
+                m = SET_RE.match(line)
+                if m and chart:
+                    self.values.setdefault(chart, {})[m.group(1)] = m.group(2)
+                    continue
+
+                m = BEGIN_RE.match(line)
+                if m:
+                    chart = m.group(1)
+                    continue
+
+                if line.startswith("END"):
+                    if chart:
+                        self.ticks[chart] = self.ticks.get(chart, 0) + 1
+                        if chart in self.history:
+                            self.history[chart].append(dict(self.values.get(chart, {})))
+                        self.lock.notify_all()
+                    chart = None
+                    continue
+
+                m = CHART_RE.match(line)
+                if m:
+                    self.charts.add(m.group(1))
+                    if "'obsolete" in line:
+                        self.obsolete.add(m.group(1))
+        with self.lock:
+            self.lock.notify_all()
+
+    def count(self, chart):
+        with self.lock:
+            return self.ticks.get(chart, 0)
+
+    def wait(self, chart, count, timeout):
+        """Waits until chart has been sent count times in all. Returns whether it was."""
+        deadline = time.monotonic() + timeout
+        with self.lock:
+            while self.ticks.get(chart, 0) < count:
+                left = deadline - time.monotonic()
+                if left <= 0 or self.proc.poll() is not None:
+                    return False
+                self.lock.wait(min(left, 0.5))
+            return True
+
+    def stats(self):
+        """The CPU seconds, read(2)/write(2) calls, peak RSS bytes and stdout bytes so far."""
+        with open("/proc/%d/stat" % self.proc.pid) as f:
+            fields = f.read().rpartition(")")[2].split()
+        cpu = (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+        calls = 0
+        with open("/proc/%d/io" % self.proc.pid) as f:
+            for line in f:
+                name, _, value = line.partition(":")
+                if name in ("syscr", "syscw"):
+                    calls += int(value)
+
+        rss = 0
+        with open("/proc/%d/status" % self.proc.pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    rss = int(line.split()[1]) * 1024
+
+        with self.lock:
+            return cpu, calls, rss, self.bytes
+
+    def rss(self):
+        """The resident memory of the plugin now, in bytes, as /proc says."""
+        with open("/proc/%d/status" % self.proc.pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1]) * 1024
+        return 0
+
+    def log(self):
+        self.stderr.flush()
+        self.stderr.seek(0)
+        return self.stderr.read()
+
+    def stop(self):
+        """Closes the stdin of the plugin, as netdata does when it exits. Returns its exit code."""
+        try:
+            self.proc.stdin.close()
+        except OSError:
+            pass
+        try:
+            self.proc.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            self.proc.terminate()
+            try:
+                self.proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+        self.stderr.close()
+        self.dir.cleanup()
+        return self.proc.returncode
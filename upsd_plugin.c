@@ -7,11 +7,11 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <upsclient.h>
-
 #include "libnetdata/libnetdata.h"
 #include "libnetdata/required_dummies.h"
 
+#include "nut_ups_status.h"
+
 #define PLUGIN_UPSD_NAME "upsd.plugin"
 
 #define NETDATA_PLUGIN_EXIT_AND_RESTART 0
@@ -46,43 +46,134 @@
 #define NETDATA_CHART_PRIO_UPSD_OUPT_FREQUENCY     70018
 #define NETDATA_CHART_PRIO_UPSD_OUPT_FREQUENCY_NOM 70019
 
+#define NETDATA_CHART_PRIO_UPSD_INPT_REALPOWER     70020
+
+// The charts which are derived from the variables of a UPS.
+#define NETDATA_CHART_PRIO_UPSD_ENERGY             70021
+#define NETDATA_CHART_PRIO_UPSD_EFFICIENCY         70022
+#define NETDATA_CHART_PRIO_UPSD_TIME_TO_EMPTY      70023
+
+#define NETDATA_CHART_PRIO_UPSD_INPT_VOLTAGE_PHASES    70030
+#define NETDATA_CHART_PRIO_UPSD_INPT_CURRENT_PHASES    70031
+#define NETDATA_CHART_PRIO_UPSD_OUPT_VOLTAGE_PHASES    70032
+#define NETDATA_CHART_PRIO_UPSD_OUPT_CURRENT_PHASES    70033
+#define NETDATA_CHART_PRIO_UPSD_OUPT_REALPOWER_PHASES  70034
+#define NETDATA_CHART_PRIO_UPSD_OUTLET_REALPOWER       70035
+#define NETDATA_CHART_PRIO_UPSD_OUTLET_CURRENT         70036
+
+// The charts which are defined in upsd.conf or discovered follow the built-in ones.
+#define NETDATA_CHART_PRIO_UPSD_CUSTOM             70100
+
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_REGISTRATION 146001
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_RECONNECTS   146002
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_OUTAGE       146003
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_MEMORY       146004
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_REQUESTS     146005
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_RTT          146006
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_COLLECTION   146007
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_OUTPUT       146008
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_LATENESS     146009
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_WORKER       146010
+#define NETDATA_CHART_PRIO_UPSD_PLUGIN_RSS          146011
+
 #define NETDATA_PLUGIN_PRECISION 100
+#define NETDATA_PLUGIN_DECIMAL_DIGITS_MAX 6
+
+// The encoding of the slots and the values of the collected data, which the agent parses
+// the same way as when it receives streamed data.
+#define NETDATA_PLUGIN_ENCODING NUMBER_ENCODING_BASE64
 
 #define BUFLEN 64
 #define LENGTHOF(arr) (sizeof(arr)/sizeof(arr[0]))
 
 static unsigned long netdata_update_every = 1;
-UPSCONN_t ups1, ups2;
-
-// Hash table mapping UPS name to another hashtable, which maps NUT variable string to
-// struct chart pointer.
-DICTIONARY *nd_ups_vars;
-
-// Hash table mapping UPS name to a boolean value indicating whether or not the UPS was
-// observed in the most recent 'LIST UPS' query.
-DICTIONARY *nd_ups_seen;
-
-// Hash table mapping UPS name to a 'cleaned' (normalized) version of the mapping name
-// which is suitable for use in NetData.
-DICTIONARY *nd_ups_name;
-
-// https://networkupstools.org/docs/developer-guide.chunked/new-drivers.html#_status_data
-struct nut_ups_status {
-    unsigned int OL      : 1; // On line
-    unsigned int OB      : 1; // On battery
-    unsigned int LB      : 1; // Low battery
-    unsigned int HB      : 1; // High battery
-    unsigned int RB      : 1; // The battery needs to be replaced
-    unsigned int CHRG    : 1; // The battery is charging
-    unsigned int DISCHRG : 1; // The battery is discharging (inverter is providing load power)
-    unsigned int BYPASS  : 1; // UPS bypass circuit is active -- no battery protection is available
-    unsigned int CAL     : 1; // UPS is currently performing runtime calibration (on battery)
-    unsigned int OFF     : 1; // UPS is offline and is not supplying power to the load
-    unsigned int OVER    : 1; // UPS is overloaded
-    unsigned int TRIM    : 1; // UPS is trimming incoming voltage (called "buck" in some hardware)
-    unsigned int BOOST   : 1; // UPS is boosting incoming voltage
-    unsigned int FSD     : 1; // Forced Shutdown
-    unsigned int OTHER   : 1;
+
+// The data collection frequency, in seconds, of the charts of the NUT variables which
+// (almost) never change, such as the nominal ratings of the UPS. It is configurable in
+// upsd.conf, and it is rounded up to a multiple of netdata_update_every.
+static time_t static_update_every = 60;
+
+// The data collection frequency, in seconds, of the UPSes which are in a steady state, and
+// the most UPSes which are collected every netdata_update_every seconds at once, because of
+// a power event. They bound the queries to upsd. They are configurable in upsd.conf, and the
+// former is rounded up to a multiple of netdata_update_every.
+static time_t steady_update_every = 1;
+static size_t fast_ups_max = 16;
+static size_t fast_ups_used = 0;
+
+// In the sub-second mode, every UPS which is due is sampled samples_per_tick times per
+// netdata_update_every, every sample_every_ut from the heartbeat of the tick, and only the
+// minimum, maximum and average of the samples are sent. It is configurable in upsd.conf,
+// and it is off (one sample per tick) by default.
+static usec_t sample_every_ut;
+static size_t samples_per_tick = 1;
+#define UPSD_SAMPLE_MIN_MS 100
+
+// The protocol of external plugins carries integers only, so the values of the charts are
+// sent in fixed point: multiplied by value_precision and rounded, for the agent to divide
+// them again. It is configurable in upsd.conf as a number of decimal digits, up to the
+// precision which the agent stores, and it is 2 by default.
+static uint32_t value_precision = NETDATA_PLUGIN_PRECISION;
+
+// Whether every UPS is a virtual node of its own, rather than a set of charts of the host of
+// the agent. It is configurable in upsd.conf.
+static bool virtual_nodes = false;
+
+// Whether the plugin charts the cost of its own collection. It is configurable in upsd.conf,
+// and it is off by default, so that the collection is not instrumented at all.
+static bool self_telemetry = false;
+
+// How often the plugin exits, so that netdata restarts it, or 0 to never restart it. It is
+// configurable in upsd.conf.
+static time_t restart_every = 0;
+static time_t plugin_started_s;
+
+// will be changed to getenv(NETDATA_USER_CONFIG_DIR) if it exists
+static char *user_config_dir = CONFIG_DIR;
+static char *stock_config_dir = LIBCONFIG_DIR;
+
+// stdout is shared by the collector threads of all upsd servers.
+static netdata_mutex_t stdout_mutex = NETDATA_MUTEX_INITIALIZER;
+static bool plugin_should_exit = false;
+
+// The statuses of a power event, during which a UPS is collected every netdata_update_every.
+#define NUT_UPS_STATUS_FAST (NUT_UPS_STATUS_OB | NUT_UPS_STATUS_LB | NUT_UPS_STATUS_DISCHRG | NUT_UPS_STATUS_OVER)
+
+// The dimensions of the status chart, in the order of the bits of enum nut_ups_status.
+static const char *ups_status_dimensions[] = {
+    "on_line",
+    "on_battery",
+    "low_battery",
+    "high_battery",
+    "replace_battery",
+    "charging",
+    "discharging",
+    "bypass",
+    "calibration",
+    "offline",
+    "overloaded",
+    "trim_input_voltage",
+    "boost_input_voltage",
+    "forced_shutdown",
+    "other",
+    "alarm",
+    "test",
+    "eco",
+    "no_communication",
+};
+
+// The NUT variables which label all of the charts of a UPS, and the titles of their
+// columns in the ups-inventory function.
+static const struct {
+    const char *nut_variable;
+    const char *label;
+    const char *title;
+} ups_labels[] = {
+    { "battery.type",  "battery_type",        "Battery Type" },
+    { "device.model",  "device_model",        "Model"        },
+    { "device.serial", "device_serial",       "Serial"       },
+    { "device.mfr",    "device_manufacturer", "Manufacturer" },
+    { "device.type",   "device_type",         "Device Type"  },
 };
 
 // https://learn.netdata.cloud/docs/developer-and-contributor-corner/external-plugins/#chart
@@ -97,6 +188,12 @@ struct nd_chart {
     const char *chart_type;
     unsigned int chart_priority;
     const char *chart_dimension;
+    bool is_static; // collected every static_update_every seconds
+
+    // The template chart which the variable is a dimension of, or NULL if the variable has a
+    // chart of its own. Only the nut_variable and the chart_dimension of the variable are
+    // used then.
+    struct nd_chart *group;
 };
 
 struct nd_chart nd_charts[] = {
@@ -176,6 +273,7 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_BATT_VOLTAGE_NOM,
         .chart_dimension = "nominal_voltage",
+        .is_static = true,
     },
     {
         .nut_variable = "input.voltage",
@@ -198,6 +296,7 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_VOLTAGE_NOM,
         .chart_dimension = "nominal_voltage",
+        .is_static = true,
     },
     {
         .nut_variable = "input.current",
@@ -220,6 +319,7 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_CURRENT_NOM,
         .chart_dimension = "nominal_current",
+        .is_static = true,
     },
     {
         .nut_variable = "input.frequency",
@@ -242,6 +342,18 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_FREQUENCY_NOM,
         .chart_dimension = "nominal_frequency",
+        .is_static = true,
+    },
+    {
+        .nut_variable = "input.realpower",
+        .chart_id = "input_realpower",
+        .chart_title = "UPS Input real power",
+        .chart_units = "Watts",
+        .chart_family = "input",
+        .chart_context = "upsd.ups_input_realpower",
+        .chart_type = "line",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_REALPOWER,
+        .chart_dimension = "realpower",
     },
     {
         .nut_variable = "output.voltage",
@@ -264,6 +376,7 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_VOLTAGE_NOM,
         .chart_dimension = "nominal_voltage",
+        .is_static = true,
     },
     {
         .nut_variable = "output.current",
@@ -286,6 +399,7 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_CURRENT_NOM,
         .chart_dimension = "nominal_current",
+        .is_static = true,
     },
     {
         .nut_variable = "output.frequency",
@@ -308,10 +422,182 @@ struct nd_chart nd_charts[] = {
         .chart_type = "line",
         .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_FREQUENCY_NOM,
         .chart_dimension = "nominal_frequency",
+        .is_static = true,
+    },
+    { 0 },
+};
+
+// The templates of the charts of the variables which come in families, such as the phases
+// of a three-phase UPS or the outlets of a PDU. The NUT variable of a template has one
+// '{<first>..<last>}' range in it, and every variable of the range which a UPS has is a
+// dimension of the one chart of the template.
+struct nd_chart nd_chart_templates[] = {
+    {
+        .nut_variable = "input.L{1..3}-N.voltage",
+        .chart_id = "input_voltage_phases",
+        .chart_title = "UPS Input voltage per phase",
+        .chart_units = "Volts",
+        .chart_family = "input",
+        .chart_context = "upsd.ups_input_voltage_phases",
+        .chart_type = "line",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_VOLTAGE_PHASES,
+    },
+    {
+        .nut_variable = "input.L{1..3}.current",
+        .chart_id = "input_current_phases",
+        .chart_title = "UPS Input current per phase",
+        .chart_units = "Ampere",
+        .chart_family = "input",
+        .chart_context = "upsd.ups_input_current_phases",
+        .chart_type = "line",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_INPT_CURRENT_PHASES,
+    },
+    {
+        .nut_variable = "output.L{1..3}-N.voltage",
+        .chart_id = "output_voltage_phases",
+        .chart_title = "UPS Output voltage per phase",
+        .chart_units = "Volts",
+        .chart_family = "output",
+        .chart_context = "upsd.ups_output_voltage_phases",
+        .chart_type = "line",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_VOLTAGE_PHASES,
+    },
+    {
+        .nut_variable = "output.L{1..3}.current",
+        .chart_id = "output_current_phases",
+        .chart_title = "UPS Output current per phase",
+        .chart_units = "Ampere",
+        .chart_family = "output",
+        .chart_context = "upsd.ups_output_current_phases",
+        .chart_type = "line",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_CURRENT_PHASES,
+    },
+    {
+        .nut_variable = "output.L{1..3}.realpower",
+        .chart_id = "output_realpower_phases",
+        .chart_title = "UPS Output real power per phase",
+        .chart_units = "Watts",
+        .chart_family = "output",
+        .chart_context = "upsd.ups_output_realpower_phases",
+        .chart_type = "stacked",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_OUPT_REALPOWER_PHASES,
+    },
+    {
+        .nut_variable = "outlet.{1..24}.realpower",
+        .chart_id = "outlet_realpower",
+        .chart_title = "UPS outlet real power",
+        .chart_units = "Watts",
+        .chart_family = "outlet",
+        .chart_context = "upsd.ups_outlet_realpower",
+        .chart_type = "stacked",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_OUTLET_REALPOWER,
+    },
+    {
+        .nut_variable = "outlet.{1..24}.current",
+        .chart_id = "outlet_current",
+        .chart_title = "UPS outlet current",
+        .chart_units = "Ampere",
+        .chart_family = "outlet",
+        .chart_context = "upsd.ups_outlet_current",
+        .chart_type = "stacked",
+        .chart_priority = NETDATA_CHART_PRIO_UPSD_OUTLET_CURRENT,
     },
     { 0 },
 };
 
+// The chart which a charted variable is collected on: its own, or that of its template.
+static inline const struct nd_chart *nd_chart_of(const struct nd_chart *chart) {
+    return chart->group ? chart->group : chart;
+}
+
+// The index of every NUT variable which the plugin knows of, in struct nut_snapshot. The
+// variables which are not charted on their own, but which are needed in order to compute
+// other metrics, come first. The charts follow: those of nd_charts[], then those which are
+// defined in upsd.conf, and then those which are discovered when the UPSes are registered.
+enum {
+    NUT_VAR_UPS_STATUS,
+    NUT_VAR_UPS_REALPOWER_NOMINAL,
+    NUT_VAR_CHARTS,
+};
+
+#define NUT_VAR_MAX 256
+
+static const char *nut_extra_vars[NUT_VAR_CHARTS] = {
+    [NUT_VAR_UPS_STATUS]            = "ups.status",
+    [NUT_VAR_UPS_REALPOWER_NOMINAL] = "ups.realpower.nominal",
+};
+
+// The chart of every index from NUT_VAR_CHARTS onwards, or NULL if it is not charted. The
+// charts which are defined in upsd.conf or discovered live as long as the plugin does.
+static struct nd_chart *nut_charts[NUT_VAR_MAX];
+
+// The number of indices in use. Indices are only added while loading upsd.conf, and while
+// registering a UPS with nut_vars_mutex held. The chart of an index is always set before
+// the index is published in nd_nut_vars, so the collector threads can read it lock-free.
+static size_t nut_vars_used = NUT_VAR_CHARTS;
+static netdata_mutex_t nut_vars_mutex = NETDATA_MUTEX_INITIALIZER;
+
+// Hash table mapping a NUT variable name to its index (plus one) in struct nut_snapshot.
+DICTIONARY *nd_nut_vars;
+
+// Whether or not the numeric variables of a UPS which are not indexed yet are charted
+// when the UPS is registered.
+static bool nut_vars_autodiscovery = false;
+
+// The indices of the nd_charts[] entries which are needed to compute the load usage, and
+// the ones which the ups-inventory function shows.
+static size_t nut_chart_realpower, nut_chart_load;
+static size_t nut_chart_charge, nut_chart_runtime;
+static size_t nut_chart_input_realpower;
+
+// A bitmap of indices in struct nut_snapshot.
+#define NUT_VARS_BITMAP_WORDS (NUT_VAR_MAX / 64)
+_Static_assert(NUT_VAR_MAX % 64 == 0, "NUT_VAR_MAX must be a multiple of 64");
+
+static inline void nut_vars_bitmap_set(uint64_t *bitmap, size_t index) {
+    bitmap[index / 64] |= 1ULL << (index % 64);
+}
+
+static inline void nut_vars_bitmap_clear(uint64_t *bitmap, size_t index) {
+    bitmap[index / 64] &= ~(1ULL << (index % 64));
+}
+
+static inline bool nut_vars_bitmap_get(const uint64_t *bitmap, size_t index) {
+    return bitmap[index / 64] & (1ULL << (index % 64));
+}
+
+// The units of the charts which are defined in upsd.conf or discovered, by the last
+// component of the NUT variable name which names a quantity (e.g. 'input.voltage.nominal').
+static const struct {
+    const char *quantity;
+    const char *units;
+} nut_chart_units[] = {
+    { "voltage",     "Volts" },
+    { "current",     "Ampere" },
+    { "frequency",   "Hz" },
+    { "temperature", "Celsius" },
+    { "humidity",    "percentage" },
+    { "realpower",   "Watts" },
+    { "power",       "VA" },
+    { "charge",      "percentage" },
+    { "load",        "percentage" },
+    { "efficiency",  "percentage" },
+    { "runtime",     "seconds" },
+};
+
+// The components of NUT variable names which identify something rather than measure it,
+// and which are never discovered even if their values are numeric.
+static const char *nut_vars_undiscoverable[] = {
+    "serial", "id", "productid", "vendorid", "firmware", "model", "mfr", "date",
+};
+
+// The values of the NUT variables of a single UPS, as returned by one 'LIST VAR' query.
+// Only the variables which are indexed in nd_nut_vars are kept.
+struct nut_snapshot {
+    bool present[NUT_VAR_MAX];
+    char value[NUT_VAR_MAX][BUFLEN];
+};
+
 static void print_version()
 {
     fputs("netdata " PLUGIN_UPSD_NAME " " NETDATA_VERSION "\n"
@@ -379,457 +665,3218 @@ static char *clean_name(char *name) {
     return name;
 }
 
-static const char *nut_get_var(UPSCONN_t *conn, const char *ups_name, const char *var_name) {
-    int rc;
-    size_t numa;
-    char **answer[1];
-    const char *query[] = { "VAR", ups_name, var_name };
-
-    rc = upscli_get(conn, LENGTHOF(query), query, &numa, (char***)answer);
-    netdata_log_debug(D_SYSTEM, "upscli_get(ups=%p, numq=%u, query={\"%s\",\"%s\",\"%s\"}, numa=%u, answer={\"%s\",\"%s\",\"%s\"}) returned %d",
-                      conn, LENGTHOF(query), query[0], query[1], query[2], numa, answer[0][1], answer[0][1], answer[0][2], rc);
-    if (unlikely(-1 == rc))
-        return NULL;
+static const char *nut_chart_units_of(const char *nut_variable) {
+    const char *end = nut_variable + strlen(nut_variable);
+
+    // Look at the components of the name from the last one backwards.
+    while (end > nut_variable) {
+        const char *start = end;
+        while (start > nut_variable && start[-1] != '.')
+            start--;
+
+        for (size_t i = 0; i < LENGTHOF(nut_chart_units); i++)
+            if (strlen(nut_chart_units[i].quantity) == (size_t)(end - start) &&
+                !strncmp(nut_chart_units[i].quantity, start, end - start))
+                return nut_chart_units[i].units;
 
-    // The output of upscli_get() will be something like:
-    //   { { [0] = "VAR", [1] = <UPS name>, [2] = <variable name>, [3] = <variable value> } }
-    return answer[0][3];
+        end = start > nut_variable ? start - 1 : start;
+    }
+
+    return "value";
 }
 
-static inline void send_BEGIN(const char *type, const char *name, usec_t usec) {
-    printf("BEGIN upsd_%s.%s %" PRIu64 "\n", type, name, usec);
+// Creates the default chart of a NUT variable which is not one of nd_charts[], named after
+// the variable. The nominal ratings are static, like those of nd_charts[].
+static struct nd_chart *nut_chart_create(const char *nut_variable, size_t index) {
+    char buf[2 * BUFLEN];
+    const char *first_dot = strchr(nut_variable, '.');
+    const char *last_dot = strrchr(nut_variable, '.');
+    struct nd_chart *chart = callocz(1, sizeof(*chart));
+
+    chart->nut_variable = strdupz(nut_variable);
+
+    strncpyz(buf, nut_variable, sizeof(buf) - 1);
+    chart->chart_id = strdupz(clean_name(buf));
+
+    snprintfz(buf, sizeof(buf), "UPS %s", nut_variable);
+    chart->chart_title = strdupz(buf);
+
+    chart->chart_units = nut_chart_units_of(nut_variable);
+    chart->chart_family = first_dot ? strndupz(nut_variable, first_dot - nut_variable) : strdupz(nut_variable);
+
+    snprintfz(buf, sizeof(buf), "upsd.ups_%s", chart->chart_id);
+    chart->chart_context = strdupz(buf);
+
+    chart->chart_type = "line";
+    chart->chart_priority = NETDATA_CHART_PRIO_UPSD_CUSTOM + index;
+    chart->chart_dimension = strdupz(last_dot ? last_dot + 1 : nut_variable);
+    chart->is_static = last_dot && streq(last_dot, ".nominal");
+
+    return chart;
 }
 
-static inline void send_SET(const char *name, int64_t value) {
-    printf("SET %s = %" PRId64 "\n", name, value);
+// Whether the index has no room left for the NUT variable, which is logged once.
+static bool nut_vars_index_full(const char *nut_variable) {
+    static bool logged = false;
+
+    if (likely(nut_vars_used < NUT_VAR_MAX))
+        return false;
+
+    if (!logged)
+        netdata_log_error("cannot index NUT variable '%s': the index is full (%d variables)", nut_variable, NUT_VAR_MAX);
+    logged = true;
+    return true;
 }
 
-static inline void send_END(void) {
-    puts("END");
+// Indexes a NUT variable, with its chart (or NULL, if it is not charted). The caller must
+// hold nut_vars_mutex, unless no collector thread is running yet. The name must live as
+// long as the index. Returns the index (plus one), or 0 if the index is full.
+static size_t nut_vars_index_add(const char *nut_variable, struct nd_chart *chart) {
+    if (unlikely(nut_vars_index_full(nut_variable)))
+        return 0;
+
+    size_t index = nut_vars_used;
+    nut_charts[index] = chart;
+    __atomic_store_n(&nut_vars_used, index + 1, __ATOMIC_RELEASE);
+    dictionary_set(nd_nut_vars, nut_variable, (void *)(index + 1), 0);
+
+    return index + 1;
 }
 
-static void set_seen(const char *ups_name, bool b) {
-    dictionary_set(nd_ups_seen, ups_name, (void *)b, 0);
+// Whether a NUT variable is a measurement with a numeric value, rather than a setting of
+// the driver or an identifier of the device.
+static bool nut_var_is_discoverable(const char *nut_variable, const char *value) {
+    char *end;
+    const char *last_dot = strrchr(nut_variable, '.');
+    const char *last = last_dot ? last_dot + 1 : nut_variable;
+
+    if (!strncmp(nut_variable, "driver.", 7) || !strncmp(nut_variable, "device.", 7))
+        return false;
+
+    for (size_t i = 0; i < LENGTHOF(nut_vars_undiscoverable); i++)
+        if (streq(last, nut_vars_undiscoverable[i]))
+            return false;
+
+    str2ndd(value, &end);
+    return end != value && *end == '\0';
 }
 
-static bool was_seen(const char *ups_name) {
-    return (bool)dictionary_get(nd_ups_seen, ups_name);
+// Returns the index (plus one) of a NUT variable of a UPS which is being registered, or 0
+// if it is not indexed. With autodiscovery enabled, the numeric variables which are not
+// indexed yet get indexed and charted, here, so that the collection of every tick only
+// ever looks the variables up.
+static size_t nut_vars_index_resolve(const char *nut_variable, const char *value) {
+    size_t index = (size_t)dictionary_get(nd_nut_vars, nut_variable);
+
+    if (index || !nut_vars_autodiscovery || !nut_var_is_discoverable(nut_variable, value))
+        return index;
+
+    netdata_mutex_lock(&nut_vars_mutex);
+
+    // Another collector thread may have discovered it in the meantime.
+    index = (size_t)dictionary_get(nd_nut_vars, nut_variable);
+    if (!index && !nut_vars_index_full(nut_variable)) {
+        struct nd_chart *chart = nut_chart_create(nut_variable, nut_vars_used);
+        index = nut_vars_index_add(chart->nut_variable, chart);
+        netdata_log_info("Discovered NUT variable: %s", nut_variable);
+    }
+
+    netdata_mutex_unlock(&nut_vars_mutex);
+
+    return index;
 }
 
-// This function parses the 'ups.status' variable and emits the Netdata metrics
-// for each status, printing 1 for each set status and 0 otherwise.
-static void send_metric_ups_status(const char *ups_name, const char *clean_ups_name, usec_t dt) {
-    struct nut_ups_status status = { 0 };
-    const char *ups_status_string = nut_get_var(&ups2, ups_name, "ups.status");
+// Parses the '{<first>..<last>}' range of the NUT variable of a chart template. Returns
+// false if the variable is not a template.
+static bool nut_chart_template_range(const char *pattern, const char **open, const char **suffix, unsigned long *first, unsigned long *last) {
+    char *end;
+
+    if (!(*open = strchr(pattern, '{')))
+        return false;
+
+    *first = strtoul(*open + 1, &end, 10);
+    if (end == *open + 1 || strncmp(end, "..", 2) != 0)
+        return false;
 
-    for (const char *c = ups_status_string; c && *c; c++) {
-        switch (*c) {
-        case ' ':
+    const char *s = end + 2;
+    *last = strtoul(s, &end, 10);
+    if (end == s || *end != '}' || *last < *first)
+        return false;
+
+    *suffix = end + 1;
+    return true;
+}
+
+// Indexes every NUT variable of the range of a chart template as a dimension of its chart,
+// named after the component of the variable which the number is in (e.g. 'L1-N' for
+// 'input.L1-N.voltage', or 'outlet1' for 'outlet.1.current'). The members of a template
+// are indexed one after the other, so that the charts of a UPS visit them in a row. The
+// variables which are indexed already keep their own charts.
+static bool nut_chart_template_expand(struct nd_chart *tmpl) {
+    const char *pattern = tmpl->nut_variable;
+    const char *open, *suffix;
+    unsigned long first, last;
+    char name[2 * BUFLEN], dimension[BUFLEN];
+
+    if (!nut_chart_template_range(pattern, &open, &suffix, &first, &last))
+        return false;
+
+    const char *component = open;
+    while (component > pattern && component[-1] != '.')
+        component--;
+    const char *component_end = suffix + strcspn(suffix, ".");
+    const char *first_dot = strchr(pattern, '.');
+
+    for (unsigned long n = first; n <= last; n++) {
+        snprintfz(name, sizeof(name), "%.*s%lu%s", (int)(open - pattern), pattern, n, suffix);
+        if (dictionary_get(nd_nut_vars, name))
             continue;
-        case 'L':
-            c++;
-            status.LB = 1;
-            break;
-        case 'H':
-            c++;
-            status.HB = 1;
-            break;
-        case 'R':
-            c++;
-            status.RB = 1;
-            break;
-        case 'D':
-            c += 6;
-            status.DISCHRG = 1;
-            break;
-        case 'T':
-            c += 3;
-            status.TRIM = 1;
-            break;
-        case 'F':
-            c += 2;
-            status.FSD = 1;
-            break;
-        case 'B':
-            switch (*++c) {
-            case 'O':
-                c += 3;
-                status.BOOST = 1;
-                break;
-            case 'Y':
-                c += 4;
-                status.BYPASS = 1;
-                break;
-            default:
-                status.OTHER = 1;
-                c = strchr(c, ' ');
-                break;
-            }
-            break;
-        case 'C':
-            switch (*++c) {
-            case 'H':
-                c += 2;
-                status.CHRG = 1;
-                break;
-            case 'A':
-                c++;
-                status.CAL = 1;
-                break;
-            default:
-                status.OTHER = 1;
-                c = strchr(c, ' ');
-                break;
-            }
-            break;
-        case 'O':
-            switch (*++c) {
-            case 'B':
-                status.OB = 1;
-                break;
-            case 'F':
-                status.OFF = 1;
-                break;
-            case 'L':
-                status.OL = 1;
-                break;
-            case 'V':
-                c += 2;
-                status.OVER = 1;
-                break;
-            default:
-                status.OTHER = 1;
-                c = strchr(c, ' ');
-                break;
-            }
-            break;
-        default:
-            status.OTHER = 1;
-            c = strchr(c, ' ');
+        if (nut_vars_index_full(name))
             break;
-        }
-    }
 
-    send_BEGIN(clean_ups_name, "status", dt);
-    send_SET("on_line", status.OL);
-    send_SET("on_battery", status.OB);
-    send_SET("low_battery", status.LB);
-    send_SET("high_battery", status.HB);
-    send_SET("replace_battery", status.RB);
-    send_SET("charging", status.CHRG);
-    send_SET("discharging", status.DISCHRG);
-    send_SET("bypass", status.BYPASS);
-    send_SET("calibration", status.CAL);
-    send_SET("offline", status.OFF);
-    send_SET("overloaded", status.OVER);
-    send_SET("trim_input_voltage", status.TRIM);
-    send_SET("boost_input_voltage", status.BOOST);
-    send_SET("forced_shutdown", status.FSD);
-    send_SET("other", status.OTHER);
-    send_END();
-}
-
-static void send_metric_ups_realpower(const char *ups_name, const char *clean_ups_name, usec_t dt) {
-    NETDATA_DOUBLE realpower;
-    const char *value = nut_get_var(&ups2, ups_name, "ups.realpower");
-
-    if (value) {
-        realpower = str2ndd(value, NULL) * NETDATA_PLUGIN_PRECISION;
-    } else {
-        value = nut_get_var(&ups2, ups_name, "ups.load");
-        if (!value)
-            return;
-        realpower = str2ndd(value, NULL) / 100;
-        value = nut_get_var(&ups2, ups_name, "ups.realpower.nominal");
-        if (!value)
-            return;
-        realpower *= str2ndd(value, NULL) * NETDATA_PLUGIN_PRECISION;
+        if (component == open && component_end == suffix && first_dot)
+            snprintfz(dimension, sizeof(dimension), "%.*s%lu", (int)(first_dot - pattern), pattern, n);
+        else
+            snprintfz(dimension, sizeof(dimension), "%.*s%lu%.*s", (int)(open - component), component, n,
+                      (int)(component_end - suffix), suffix);
+
+        struct nd_chart *member = callocz(1, sizeof(*member));
+        member->nut_variable = strdupz(name);
+        member->chart_dimension = strdupz(dimension);
+        member->group = tmpl;
+        nut_vars_index_add(member->nut_variable, member);
     }
 
-    send_BEGIN(clean_ups_name, "load_usage", dt);
-    send_SET("load_usage", realpower);
-    send_END();
+    return true;
 }
 
-static void register_ups(char *ups_name) {
-    const char *nut_value;
-    const char *clean_ups_name = clean_name(dictionary_set(nd_ups_name, ups_name, ups_name, strlen(ups_name)+1));
+// Creates the default template of the charts of a range of NUT variables which is not one
+// of nd_chart_templates[], named after the variables without their range.
+static struct nd_chart *nut_chart_template_create(const char *pattern, size_t index) {
+    const char *open, *suffix;
+    unsigned long first, last;
+    char name[2 * BUFLEN];
 
-    netdata_log_info("Registering UPS '%s' for Netdata metric collection", ups_name);
+    if (!nut_chart_template_range(pattern, &open, &suffix, &first, &last))
+        return NULL;
 
-    // CHART type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
-    printf("CHART 'upsd_%s.status' '' 'UPS status' 'status' 'ups' 'upsd.ups_status' 'line' %u %lu\n",
-           clean_ups_name, NETDATA_CHART_PRIO_UPSD_UPS_STATUS, netdata_update_every);
-
-    if ((nut_value = nut_get_var(&ups2, ups_name, "battery.type")))
-        printf("CLABEL battery_type '%s' %u\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-    if ((nut_value = nut_get_var(&ups2, ups_name, "device.model")))
-        printf("CLABEL device_model '%s' %u\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-    if ((nut_value = nut_get_var(&ups2, ups_name, "device.serial")))
-        printf("CLABEL device_serial '%s' %u\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-    if ((nut_value = nut_get_var(&ups2, ups_name, "device.mfr")))
-        printf("CLABEL device_manufacturer '%s' %u\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-    if ((nut_value = nut_get_var(&ups2, ups_name, "device.type")))
-        printf("CLABEL device_type '%s' %u\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
+    // The component of the range is left out, if the range is all of it.
+    if ((open == pattern || open[-1] == '.') && *suffix == '.')
+        suffix++;
+    snprintfz(name, sizeof(name), "%.*s%s", (int)(open - pattern), pattern, suffix);
 
-    // CLABEL name value source
-    // CLABEL_COMMIT
-    printf("CLABEL ups_name '%s' %u\n"
-           "CLABEL_COMMIT\n",
-           ups_name, NETDATA_CLABEL_SOURCE_AUTO);
-
-    // DIMENSION id [name [algorithm [multiplier [divisor [options]]]]]
-    printf("DIMENSION on_line '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION on_battery '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION low_battery '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION high_battery '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION replace_battery '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION charging '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION discharging '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION bypass '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION calibration '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION offline '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION overloaded '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION trim_input_voltage '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION boost_input_voltage '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION forced_shutdown '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-    printf("DIMENSION other '' '' '' %u\n", NETDATA_PLUGIN_PRECISION);
-
-    // Hash table mapping NUT variable (e.g. 'ups.status') to pointer to respective `struct nd_chart`.
-    DICTIONARY *ups_vars = dictionary_create(DICT_OPTION_SINGLE_THREADED|DICT_OPTION_FIXED_SIZE|DICT_OPTION_NAME_LINK_DONT_CLONE|DICT_OPTION_VALUE_LINK_DONT_CLONE);
-
-    for (struct nd_chart *chart = nd_charts; chart->nut_variable; chart++) {
-        nut_value = nut_get_var(&ups2, ups_name, chart->nut_variable);
-        if (!nut_value) {
-            if (!streq(chart->nut_variable, "ups.realpower"))
-                continue;
-            // If the UPS does not support the 'ups.realpower' variable, then
-            // we can still calculate the load_usage if the 'ups.load' and
-            // 'ups.realpower.nominal' variables are available.
-            if (!nut_get_var(&ups2, ups_name, "ups.load") || !nut_get_var(&ups2, ups_name, "ups.realpower.nominal"))
-                continue;
-        }
+    struct nd_chart *tmpl = nut_chart_create(name, index);
+    freez((void *)tmpl->nut_variable);
+    tmpl->nut_variable = strdupz(pattern);
+    return tmpl;
+}
 
-        netdata_log_info("Collecting UPS '%s' NUT variable: %s", ups_name, chart->nut_variable);
+static void nut_vars_index_init(void) {
+    // It is shared by the collector threads of all upsd servers.
+    nd_nut_vars = dictionary_create(DICT_OPTION_FIXED_SIZE|DICT_OPTION_NAME_LINK_DONT_CLONE|DICT_OPTION_VALUE_LINK_DONT_CLONE);
 
-        // CHART type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
-        printf("CHART 'upsd_%s.%s' '' '%s' '%s' '%s' '%s' '%s' '%u' '%lu' '' '" PLUGIN_UPSD_NAME "'\n",
-               clean_ups_name, chart->chart_id, // type.id
-               chart->chart_title,    // title
-               chart->chart_units,    // units
-               chart->chart_family,   // family
-               chart->chart_context,  // context
-               chart->chart_type,     // charttype
-               chart->chart_priority, // priority
-               netdata_update_every); // update_every
-
-        if ((nut_value = nut_get_var(&ups2, ups_name, "battery.type")))
-            printf("CLABEL 'battery_type' '%s' '%u'\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-        if ((nut_value = nut_get_var(&ups2, ups_name, "device.model")))
-            printf("CLABEL 'device_model' '%s' '%u'\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-        if ((nut_value = nut_get_var(&ups2, ups_name, "device.serial")))
-            printf("CLABEL 'device_serial' '%s' '%u'\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-        if ((nut_value = nut_get_var(&ups2, ups_name, "device.mfr")))
-            printf("CLABEL 'device_manufacturer' '%s' '%u'\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-        if ((nut_value = nut_get_var(&ups2, ups_name, "device.type")))
-            printf("CLABEL 'device_type' '%s' '%u'\n", nut_value, NETDATA_CLABEL_SOURCE_AUTO);
-
-        // CLABEL name value source
-        // CLABEL_COMMIT
-        printf("CLABEL 'ups_name' '%s' %u\n"
-               "CLABEL_COMMIT\n",
-               ups_name, NETDATA_CLABEL_SOURCE_AUTO);
+    for (size_t i = 0; i < LENGTHOF(nut_extra_vars); i++)
+        dictionary_set(nd_nut_vars, nut_extra_vars[i], (void *)(i + 1), 0);
 
-        // DIMENSION id [name [algorithm [multiplier [divisor [options]]]]]
-        printf("DIMENSION '%s' '' '' '' %u\n", chart->chart_dimension, NETDATA_PLUGIN_PRECISION);
+    for (size_t i = 0; nd_charts[i].nut_variable; i++)
+        nut_vars_index_add(nd_charts[i].nut_variable, &nd_charts[i]);
 
-        dictionary_set(ups_vars, chart->nut_variable, chart, 0);
-    }
-    dictionary_set(nd_ups_vars, ups_name, ups_vars, 0);
+    for (size_t i = 0; nd_chart_templates[i].nut_variable; i++)
+        nut_chart_template_expand(&nd_chart_templates[i]);
+
+    nut_chart_realpower = (size_t)dictionary_get(nd_nut_vars, "ups.realpower") - 1;
+    nut_chart_load = (size_t)dictionary_get(nd_nut_vars, "ups.load") - 1;
+    nut_chart_charge = (size_t)dictionary_get(nd_nut_vars, "battery.charge") - 1;
+    nut_chart_runtime = (size_t)dictionary_get(nd_nut_vars, "battery.runtime") - 1;
+    nut_chart_input_realpower = (size_t)dictionary_get(nd_nut_vars, "input.realpower") - 1;
 }
 
-int main(int argc, char *argv[]) {
-    int rc;
-    size_t numa;
-    char *ups_name;
-    char **answer[1];
-    const char *query[] = { "UPS" };
-    struct nd_chart *chart;
+static inline const char *nut_snapshot_get(const struct nut_snapshot *snap, size_t index) {
+    return snap->present[index] ? snap->value[index] : NULL;
+}
 
-    parse_command_line(argc, argv);
+static inline NETDATA_DOUBLE nut_snapshot_get_double(const struct nut_snapshot *snap, size_t index) {
+    const char *value = nut_snapshot_get(snap, index);
+    return value ? str2ndd(value, NULL) : NAN;
+}
 
-    nd_log_initialize_for_external_plugins(PLUGIN_UPSD_NAME);
-    netdata_threads_init_for_external_plugins(0);
+// ----------------------------------------------------------------------------
+// Captures of NUT sessions
+//
+// A capture is a file of timestamped records of what the connection to a upsd server wrote
+// and read. So, a session can be replayed in place of upsd: at full speed, to benchmark the
+// parsing and the output of the plugin apart from the network, or in real time, to
+// reproduce the charts of a power event. A replay only matches its capture when upsd.conf
+// is the same.
+
+#define NUT_CAPTURE_MAGIC     "NUTCAP1\n"
+#define NUT_CAPTURE_EXTENSION ".nutcap"
+
+enum nut_capture_mode {
+    NUT_CAPTURE_OFF = 0,
+    NUT_CAPTURE_RECORD,
+    NUT_CAPTURE_REPLAY,
+};
 
-    nd_ups_vars = dictionary_create(DICT_OPTION_SINGLE_THREADED|DICT_OPTION_FIXED_SIZE|DICT_OPTION_VALUE_LINK_DONT_CLONE);
-    nd_ups_seen = dictionary_create(DICT_OPTION_SINGLE_THREADED|DICT_OPTION_FIXED_SIZE|DICT_OPTION_VALUE_LINK_DONT_CLONE);
-    nd_ups_name = dictionary_create(DICT_OPTION_SINGLE_THREADED);
+enum nut_capture_type {
+    NUT_CAPTURE_SENT     = 'S', // the bytes written to upsd
+    NUT_CAPTURE_RECEIVED = 'R', // the bytes read from upsd, as they were read
+};
 
-    rc = upscli_init(0, NULL, NULL, NULL);
-    netdata_log_debug(D_SYSTEM, "upscli_init(certverify=0, certpath=NULL, certname=NULL, certpasswd=NULL) returned %d", rc);
-    if (unlikely(-1 == rc)) {
-        netdata_log_error("failed to initialize libupsclient");
-        return NETDATA_PLUGIN_EXIT_AND_DISABLE;
-    }
+// Every record is this header, followed by 'length' bytes.
+struct nut_capture_record {
+    uint64_t offset_ut; // since the capture was started
+    uint32_t length;
+    uint8_t type;
+} __attribute__((packed));
+
+struct nut_capture {
+    FILE *fp;
+    enum nut_capture_mode mode;
+    usec_t started_ut;
+};
 
-    rc = upscli_connect(&ups1, "127.0.0.1", 3493, 0);
-    netdata_log_debug(D_SYSTEM, "upscli_connect(ups=%p, host=\"127.0.0.1\", port=3493, flags=0) returned %d", &ups1, rc);
-    if (unlikely(-1 == rc)) {
-        upscli_cleanup();
-        netdata_log_error("failed to connect to upsd at 127.0.0.1:3493");
-        return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+// The captures are configured in upsd.conf, with one file per upsd server in the directory.
+static enum nut_capture_mode nut_capture_mode = NUT_CAPTURE_OFF;
+static const char *nut_capture_directory;
+static bool nut_capture_realtime = false;
+
+static bool nut_capture_open(struct nut_capture *cap, const char *server_id) {
+    char filename[FILENAME_MAX + 1];
+    char magic[sizeof(NUT_CAPTURE_MAGIC) - 1];
+
+    cap->mode = nut_capture_mode;
+    if (cap->mode == NUT_CAPTURE_OFF)
+        return true;
+
+    snprintfz(filename, sizeof(filename), "%s/%s" NUT_CAPTURE_EXTENSION, nut_capture_directory, server_id);
+    cap->fp = fopen(filename, cap->mode == NUT_CAPTURE_RECORD ? "w" : "r");
+    if (!cap->fp) {
+        netdata_log_error("failed to open the NUT capture '%s': %s", filename, strerror(errno));
+        if (cap->mode == NUT_CAPTURE_RECORD)
+            cap->mode = NUT_CAPTURE_OFF;
+        return false;
     }
 
-    rc = upscli_connect(&ups2, "127.0.0.1", 3493, 0);
-    netdata_log_debug(D_SYSTEM, "upscli_connect(ups=%p, host=\"127.0.0.1\", port=3493, flags=0) returned %d", &ups2, rc);
-    if (unlikely(-1 == rc)) {
-        upscli_cleanup();
-        netdata_log_error("failed to connect to upsd at 127.0.0.1:3493");
-        return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+    if (cap->mode == NUT_CAPTURE_RECORD)
+        fwrite(NUT_CAPTURE_MAGIC, 1, sizeof(magic), cap->fp);
+    else if (fread(magic, 1, sizeof(magic), cap->fp) != sizeof(magic) || memcmp(magic, NUT_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        netdata_log_error("'%s' is not a NUT capture", filename);
+        fclose(cap->fp);
+        cap->fp = NULL;
+        return false;
     }
 
-    // Set stdout to block-buffered, to make printf() faster.
-    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+    netdata_log_info("%s the NUT session of upsd '%s' %s '%s'", cap->mode == NUT_CAPTURE_RECORD ? "recording" : "replaying",
+                     server_id, cap->mode == NUT_CAPTURE_RECORD ? "to" : "from", filename);
 
-    rc = upscli_list_start(&ups1, LENGTHOF(query), query);
-    netdata_log_debug(D_SYSTEM, "upscli_list_start(ups=%p, numq=%u, query={\"%s\"}) returned %d",
-                      &ups1, LENGTHOF(query), query[0]);
-    if (unlikely(-1 == rc)) {
-        netdata_log_error("failed to list UPSes from upsd: %s", upscli_strerror(&ups1));
-        return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+    cap->started_ut = now_monotonic_usec();
+    return true;
+}
+
+static void nut_capture_close(struct nut_capture *cap) {
+    if (cap->fp)
+        fclose(cap->fp);
+    cap->fp = NULL;
+}
+
+static inline bool nut_capture_recording(const struct nut_capture *cap) {
+    return cap->mode == NUT_CAPTURE_RECORD;
+}
+
+static inline bool nut_capture_replaying(const struct nut_capture *cap) {
+    return cap->mode == NUT_CAPTURE_REPLAY;
+}
+
+static void nut_capture_write(struct nut_capture *cap, enum nut_capture_type type, const void *data, size_t length) {
+    struct nut_capture_record record = {
+        .offset_ut = now_monotonic_usec() - cap->started_ut,
+        .length = length,
+        .type = type,
+    };
+
+    if (unlikely(fwrite(&record, sizeof(record), 1, cap->fp) != 1 || fwrite(data, 1, length, cap->fp) != length)) {
+        netdata_log_error("failed to write the NUT capture: %s; recording stopped", strerror(errno));
+        nut_capture_close(cap);
+        cap->mode = NUT_CAPTURE_OFF;
     }
+}
+
+// Reads the next record which is not of what was sent to upsd, into data, of the given size.
+// In real time, it waits until as long after the start of the replay as the record was
+// after the start of the capture. Returns the length of the record, or -1 at the end of
+// the capture (with errno set to ENODATA), or on failure.
+static ssize_t nut_capture_read(struct nut_capture *cap, enum nut_capture_type type, void *data, size_t size) {
+    struct nut_capture_record record;
 
     for (;;) {
-        // The output of upscli_list_next() is stored in `answer` like so:
-        //  [
-        //    { [0] = "UPS", [1] = <UPS name>, [2] = <UPS description> },
-        //    { [0] = "UPS", [1] = <UPS name>, [2] = <UPS description> },
-        //    { [0] = "END", [1] = "LIST", [2] = "UPS" },
-        //  ]
-        rc = upscli_list_next(&ups1, LENGTHOF(query), query, &numa, (char***)&answer);
-        netdata_log_debug(D_SYSTEM, "upscli_list_next(ups=%p, numq=%u, query={\"%s\"}, numa=%u, answer={\"%s\",\"%s\",\"%s\"}) returned %d",
-                          &ups1, LENGTHOF(query), query[0], numa, answer[0][0], answer[0][1], answer[0][2]);
-        if (unlikely(-1 == rc)) {
-            netdata_log_error("failed to list UPSes from upsd: %s", upscli_strerror(&ups1));
-            return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+        if (fread(&record, sizeof(record), 1, cap->fp) != 1) {
+            errno = ENODATA;
+            return -1;
         }
 
-        // Unfortunately, upscli_list_next() will inform us of the end of the list
-        // only AFTER it has processed and returned the {"END","LIST","UPS"} entry.
-        // That entry could be confusing, and could mistakenly register a UPS
-        // named "LIST", so let's skip processing on that item.
-        if (streq("END", answer[0][0]))
+        if (record.type != NUT_CAPTURE_SENT)
             break;
 
-        register_ups(answer[0][1]);
+        if (fseek(cap->fp, record.length, SEEK_CUR) != 0)
+            return -1;
     }
 
-    time_t started_t = now_monotonic_sec();
+    // The plugin does the same as it did when it recorded, so the records come in the same order.
+    if (unlikely(record.type != type || record.length > size)) {
+        errno = EPROTO;
+        return -1;
+    }
 
-    heartbeat_t hb;
-    heartbeat_init(&hb, netdata_update_every * USEC_PER_SEC);
-    for (;;) {
-        usec_t dt = heartbeat_next(&hb);
+    if (nut_capture_realtime) {
+        usec_t now_ut = now_monotonic_usec();
+        if (cap->started_ut + record.offset_ut > now_ut)
+            sleep_usec(cap->started_ut + record.offset_ut - now_ut);
+    }
 
-        if (unlikely(exit_initiated_get()))
-            break;
+    if (fread(data, 1, record.length, cap->fp) != record.length) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    return record.length;
+}
+
+// ----------------------------------------------------------------------------
+// A minimal, non-blocking client of the NUT network protocol.
+// https://networkupstools.org/docs/developer-guide.chunked/net-protocol.html
+//
+// Unlike libupsclient, which waits for the response of every query before sending the
+// next one, all of the queries of a tick are queued with nut_client_request_list() and
+// written back to back, while the responses are parsed from a reusable receive buffer
+// as they arrive. So, a tick costs one network round trip, rather than one per query.
+
+#define NUT_CLIENT_RBUF_SIZE   (16 * 1024)
+#define NUT_CLIENT_MAX_WORDS   8
+#define NUT_CLIENT_TIMEOUT_SEC 10
+
+// Whether the connections to upsd are upgraded to TLS with the STARTTLS command, and how
+// the certificate of upsd is verified. They are configurable in upsd.conf, and TLS is off
+// by default, as it is in upsd. The context is shared by the collector threads of all upsd
+// servers.
+static bool nut_client_starttls = false;
+static bool nut_client_tls_verify = true;
+static const char *nut_client_tls_ca_file;
+static const char *nut_client_tls_ca_path;
+static SSL_CTX *nut_client_tls_ctx;
+
+// The idle time after which the kernel probes the connections to upsd, or 0 to not probe
+// them. Every tick queries upsd, so the probes only keep alive the connections whose ticks
+// are longer than the idle timeouts of the network, e.g. those of NAT gateways and
+// firewalls. It is configurable in upsd.conf.
+static time_t nut_client_keepalive = 60;
+
+// A query which awaits its response: where it ends in all of the bytes queued on the
+// connection, and when it was written in full, or 0.
+struct nut_client_query {
+    uint64_t end;
+    usec_t sent_ut;
+};
+
+struct nut_client {
+    ND_SOCK sock;
+    nd_poll_t *ndpl;
+
+    BUFFER *wb;    // the queued queries
+    size_t sent;   // the number of bytes of wb which have been written
+
+    size_t rlen;   // the number of bytes in rbuf
+    size_t rpos;   // the offset of the first unparsed byte in rbuf
+    char rbuf[NUT_CLIENT_RBUF_SIZE];
+
+    // the words of the last line read
+    char *words[NUT_CLIENT_MAX_WORDS];
+    size_t num_words;
+
+    // the session is recorded, or replayed in place of upsd
+    struct nut_capture capture;
+
+    // the TLS session of the previous connection, which the next one resumes
+    SSL_SESSION *tls_session;
+
+    // Only with self_telemetry: the queries which await their responses, oldest first, and
+    // the response times of the queries since they were last taken. A query is timed from
+    // when it was written, or from when the response to the previous one was read, if that
+    // is later, until its own response is read, so that the time upsd took for the queries
+    // before it in the pipeline does not add up.
+    struct nut_client_query *queries;
+    size_t queries_head;   // the oldest query which awaits its response
+    size_t queries_sent;   // the oldest query which is not written in full yet
+    size_t queries_used;
+    size_t queries_size;
+    uint64_t queued;       // the bytes queued since the connection was made
+    uint64_t written;      // the bytes written since the connection was made
+    usec_t response_ut;    // when the previous response was read
+    usec_t *rtt;
+    size_t rtt_used;
+    size_t rtt_size;
+};
+
+static inline bool nut_client_timed(const struct nut_client *c) {
+    return unlikely(self_telemetry) && !nut_capture_replaying(&c->capture);
+}
+
+// Takes note of a query which was just queued.
+static void nut_client_query_queued(struct nut_client *c) {
+    if (c->queries_used == c->queries_size) {
+        c->queries_size = c->queries_size ? c->queries_size * 2 : 64;
+        c->queries = reallocz(c->queries, c->queries_size * sizeof(*c->queries));
+    }
+
+    c->queries[c->queries_used++] = (struct nut_client_query){ .end = c->queued };
+}
 
-        rc = upscli_list_start(&ups1, LENGTHOF(query), query);
-        netdata_log_debug(D_SYSTEM, "upscli_list_start(ups=%p, numq=%u, query={\"%s\"}) returned %d",
-                          &ups1, LENGTHOF(query), query[0]);
-        if (unlikely(-1 == rc)) {
-            netdata_log_error("failed to list UPSes from upsd: %s", upscli_strerror(&ups1));
-            return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+// Takes note of the queries which were written in full, now that 'written' bytes were.
+static void nut_client_query_written(struct nut_client *c) {
+    usec_t now_ut = now_monotonic_usec();
+
+    while (c->queries_sent < c->queries_used && c->queries[c->queries_sent].end <= c->written)
+        c->queries[c->queries_sent++].sent_ut = now_ut;
+}
+
+// Takes the response time of the oldest query, whose response was just read in full.
+static void nut_client_query_responded(struct nut_client *c) {
+    if (c->queries_head == c->queries_used)
+        return;
+
+    usec_t now_ut = now_monotonic_usec();
+    const struct nut_client_query *q = &c->queries[c->queries_head++];
+
+    if (q->sent_ut) {
+        if (c->rtt_used == c->rtt_size) {
+            c->rtt_size = c->rtt_size ? c->rtt_size * 2 : 64;
+            c->rtt = reallocz(c->rtt, c->rtt_size * sizeof(*c->rtt));
         }
+        c->rtt[c->rtt_used++] = now_ut - MAX(q->sent_ut, c->response_ut);
+    }
+    c->response_ut = now_ut;
 
-        for (;;) {
-            rc = upscli_list_next(&ups1, LENGTHOF(query), query, &numa, (char***)&answer);
-            netdata_log_debug(D_SYSTEM, "upscli_list_next(ups=%p, numq=%u, query={\"%s\"}, numa=%u, answer={\"%s\",\"%s\",\"%s\"}) returned %d",
-                              &ups1, LENGTHOF(query), query[0], numa, answer[0][0], answer[0][1], answer[0][2]);
-            if (unlikely(-1 == rc)) {
-                netdata_log_error("failed to list UPSes from upsd: %s", upscli_strerror(&ups1));
-                return NETDATA_PLUGIN_EXIT_AND_DISABLE;
-            }
+    // The pipeline is empty at the end of every tick, so the queries start over.
+    if (c->queries_head == c->queries_used)
+        c->queries_head = c->queries_sent = c->queries_used = 0;
+}
 
-            if (streq("END", answer[0][0]))
-                break;
+// Keeps a copy of the session which upsd issued for the connection, for the next one to
+// resume. With TLS 1.3, upsd issues it after the handshake, and OpenSSL makes the session of
+// a connection which fails unresumable, so it is copied as soon as it is issued, rather than
+// taken when the connection is lost.
+static int nut_client_tls_session_new(SSL *conn, SSL_SESSION *session) {
+    struct nut_client *c = SSL_get_app_data(conn);
+    SSL_SESSION *copy = c ? SSL_SESSION_dup(session) : NULL;
+
+    if (copy) {
+        if (c->tls_session)
+            SSL_SESSION_free(c->tls_session);
+        c->tls_session = copy;
+    }
+    return 0;
+}
 
-            ups_name = answer[0][1];
-            char *clean_ups_name = dictionary_get(nd_ups_name, ups_name);
-            if (!clean_ups_name) {
-                register_ups(ups_name);
-                clean_ups_name = dictionary_get(nd_ups_name, ups_name);
-            }
+// Creates the TLS context of the connections to upsd. Returns false on failure.
+static bool nut_client_tls_init(void) {
+    netdata_ssl_initialize_openssl();
+
+    // The queries may be written in parts, from a buffer which grows meanwhile.
+    nut_client_tls_ctx = netdata_ssl_create_client_ctx(SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (!nut_client_tls_ctx) {
+        netdata_log_error("failed to create the TLS context of the connections to upsd");
+        return false;
+    }
+
+    // The sessions which upsd issues are kept by the connections, for the next ones to resume.
+    SSL_CTX_set_session_cache_mode(nut_client_tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(nut_client_tls_ctx, nut_client_tls_session_new);
 
-            set_seen(ups_name, true);
+    if (nut_client_tls_verify) {
+        if (ssl_security_location_for_context(nut_client_tls_ctx, nut_client_tls_ca_file, nut_client_tls_ca_path) == -1) {
+            netdata_log_error("failed to load the certificates to verify upsd with");
+            return false;
+        }
+        SSL_CTX_set_verify(nut_client_tls_ctx, SSL_VERIFY_PEER, NULL);
+    }
+    else
+        SSL_CTX_set_verify(nut_client_tls_ctx, SSL_VERIFY_NONE, NULL);
+
+    return true;
+}
+
+// Drives the TLS handshake on the non-blocking socket, so that it takes at most
+// NUT_CLIENT_TIMEOUT_SEC, however slowly upsd answers it, or if it never does (e.g. it carries
+// on in plaintext after accepting STARTTLS). Returns NULL, or why the handshake failed.
+static const char *nut_client_tls_handshake(struct nut_client *c) {
+    SSL *conn = c->sock.ssl.conn;
+    usec_t deadline_ut = now_monotonic_usec() + NUT_CLIENT_TIMEOUT_SEC * USEC_PER_SEC;
+    int rc;
+
+    SSL_set_connect_state(conn);
+    ERR_clear_error();
+
+    while ((rc = SSL_connect(conn)) != 1) {
+        struct pollfd pfd = { .fd = c->sock.fd };
 
-            // The 'ups.status' variable is a special case, because its chart has more
-            // than one dimension. So, we can't simply print one data point.
-            send_metric_ups_status(ups_name, clean_ups_name, dt);
+        switch (SSL_get_error(conn, rc)) {
+            case SSL_ERROR_WANT_READ:
+                pfd.events = POLLIN;
+                break;
 
-            // The 'ups.realpower' variable is another special case, because if it is
-            // not available, then it can be calculated from the ups.load and
-            // ups.realpower.nominal variables.
-            send_metric_ups_realpower(ups_name, clean_ups_name, dt);
+            case SSL_ERROR_WANT_WRITE:
+                pfd.events = POLLOUT;
+                break;
 
-            DICTIONARY *ups_vars = dictionary_get(nd_ups_vars, ups_name);
-            dfe_start_read(ups_vars, chart) {
-                const char *value = nut_get_var(&ups2, ups_name, chart->nut_variable);
-                NETDATA_DOUBLE nut_value_as_num = str2ndd(value, NULL) * NETDATA_PLUGIN_PRECISION;
-                send_BEGIN(clean_ups_name, chart->chart_id, dt);
-                send_SET(chart->chart_dimension, nut_value_as_num);
-                send_END();
+            default: {
+                c->sock.ssl.ssl_errno = ERR_peek_last_error();
+                c->sock.ssl.state = NETDATA_SSL_STATE_FAILED;
+                const char *reason = ERR_reason_error_string(c->sock.ssl.ssl_errno);
+                return reason ? reason : "the connection was closed";
             }
-            dfe_done(chart);
         }
 
-        // stdout, stderr are connected to pipes.
-        // So, if they are closed then netdata must have exited.
-        // Flush the data out of the stream buffer to ensure netdata gets it immediately.
-        fflush(stdout);
-        if (unlikely(ferror(stdout) && errno == EPIPE)) {
-            netdata_log_error("failed to fflush(3) upsd data: %s", strerror(errno));
-            return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+        usec_t now_ut = now_monotonic_usec();
+        if (now_ut >= deadline_ut) {
+            errno = ETIMEDOUT;
+            c->sock.ssl.state = NETDATA_SSL_STATE_FAILED;
+            return "timed out";
         }
 
-        if (unlikely(exit_initiated_get()))
-            break;
+        if (poll(&pfd, 1, (int)((deadline_ut - now_ut + USEC_PER_MS - 1) / USEC_PER_MS)) < 0 && errno != EINTR) {
+            c->sock.ssl.state = NETDATA_SSL_STATE_FAILED;
+            return strerror(errno);
+        }
+    }
 
-        // restart check (14400 seconds)
-        if (unlikely(now_monotonic_sec() - started_t > 14400))
-            break;
+    c->sock.ssl.state = NETDATA_SSL_STATE_COMPLETE;
+    return NULL;
+}
 
-        // Delete unseen UPS entries from dictionary/memory.
-        dfe_start_read(nd_ups_name, ups_name) {
-            if (was_seen(ups_name)) {
-                set_seen(ups_name, false);
-            } else {
-                DICTIONARY *ups_vars = dictionary_get(nd_ups_vars, ups_name);
-                dictionary_destroy(ups_vars);
-                dictionary_del(nd_ups_vars, ups_name);
-                dictionary_del(nd_ups_seen, ups_name);
-                dictionary_del(nd_ups_name, ups_name);
-            }
+// Upgrades a new connection to upsd to TLS:
+//   STARTTLS
+//   OK STARTTLS
+// and then the handshake, with the socket non-blocking from there on. The session of the
+// previous connection is resumed, if upsd still has it, which spares the costly part of the
+// handshake on every reconnection.
+static bool nut_client_starttls_negotiate(struct nut_client *c, const char *host, int port) {
+    char line[BUFLEN];
+    size_t len = 0;
+
+    if (nd_sock_write_persist(&c->sock, "STARTTLS\n", 9, 10) != 9) {
+        netdata_log_error("failed to send STARTTLS to upsd at %s:%d: %s", host, port, strerror(errno));
+        return false;
+    }
+
+    while (!memchr(line, '\n', len)) {
+        ssize_t bytes = len < sizeof(line) - 1 ?
+            nd_sock_recv_timeout(&c->sock, &line[len], sizeof(line) - 1 - len, 0, NUT_CLIENT_TIMEOUT_SEC) : 0;
+        if (bytes <= 0) {
+            netdata_log_error("failed to read the response of upsd at %s:%d to STARTTLS", host, port);
+            return false;
         }
-        dfe_done(ups_name);
+        len += bytes;
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strcmp(line, "OK STARTTLS") != 0) {
+        netdata_log_error("upsd at %s:%d refused STARTTLS: %s", host, port, line);
+        return false;
+    }
+
+    sock_setnonblock(c->sock.fd, true);
+
+    c->sock.ctx = nut_client_tls_ctx;
+    if (!netdata_ssl_open(&c->sock.ssl, nut_client_tls_ctx, c->sock.fd))
+        return false;
+
+    // The certificate of upsd has to be issued for the host which upsd.conf names.
+    SSL *conn = c->sock.ssl.conn;
+    struct in6_addr addr;
+    if (inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1)
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn), host);
+    else {
+        SSL_set_tlsext_host_name(conn, host);
+        SSL_set1_host(conn, host);
+    }
+
+    SSL_set_app_data(conn, c);
+    if (c->tls_session)
+        SSL_set_session(conn, c->tls_session);
+
+    const char *error = nut_client_tls_handshake(c);
+    if (error) {
+        netdata_log_error("failed the TLS handshake with upsd at %s:%d: %s", host, port, error);
+        return false;
+    }
+
+    netdata_log_debug(D_SYSTEM, "TLS session with upsd at %s:%d was %s", host, port,
+                      SSL_session_reused(conn) ? "resumed" : "established");
+    return true;
+}
+
+static void nut_client_keepalive_set(int fd) {
+    int on = 1, idle = (int)nut_client_keepalive, interval = (int)nut_client_keepalive / 4 + 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0)
+        return;
+#ifdef TCP_KEEPIDLE
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+}
+
+// The buffer of the client is accounted in 'statistics'.
+static bool nut_client_connect(struct nut_client *c, const char *host, int port, size_t *statistics) {
+    nd_sock_init(&c->sock, NULL, false);
+
+    if (nut_capture_replaying(&c->capture)) {
+        c->wb = buffer_create(4096, statistics);
+        c->sent = c->rlen = c->rpos = 0;
+        return true;
+    }
+
+    // The definition of the connection takes the first ':' for the start of the port, unless
+    // the host is in brackets, so an IPv6 address has to be.
+    char definition[strlen(host) + 3];
+    snprintfz(definition, sizeof(definition), strchr(host, ':') ? "[%s]" : "%s", host);
+
+    if (!nd_sock_connect_to_this(&c->sock, definition, port, NUT_CLIENT_TIMEOUT_SEC, false)) {
+        netdata_log_error("failed to connect to upsd at %s:%d: %s", host, port, ND_SOCK_ERROR_2str(c->sock.error));
+        return false;
+    }
+
+    if (nut_client_tls_ctx && !nut_client_starttls_negotiate(c, host, port)) {
+        nd_sock_close(&c->sock);
+        return false;
     }
 
-    dfe_start_read(nd_ups_name, ups_name) {
-        DICTIONARY *ups_vars = dictionary_get(nd_ups_vars, ups_name);
-        dictionary_destroy(ups_vars);
-        dictionary_del(nd_ups_vars, ups_name);
-        dictionary_del(nd_ups_seen, ups_name);
-        dictionary_del(nd_ups_name, ups_name);
+    if (nut_client_keepalive)
+        nut_client_keepalive_set(c->sock.fd);
+
+    sock_setnonblock(c->sock.fd, true);
+
+    c->ndpl = nd_poll_create();
+    if (!c->ndpl || !nd_poll_add(c->ndpl, c->sock.fd, ND_POLL_READ, c)) {
+        netdata_log_error("failed to poll the connection to upsd at %s:%d", host, port);
+        if (c->ndpl)
+            nd_poll_destroy(c->ndpl);
+        c->ndpl = NULL;
+        nd_sock_close(&c->sock);
+        return false;
     }
-    dfe_done(ups_name);
 
-    dictionary_destroy(nd_ups_vars);
-    dictionary_destroy(nd_ups_seen);
-    dictionary_destroy(nd_ups_name);
+    c->wb = buffer_create(4096, statistics);
+    c->sent = c->rlen = c->rpos = 0;
+    c->queries_head = c->queries_sent = c->queries_used = 0;
+    c->queued = c->written = 0;
+    return true;
+}
+
+static void nut_client_disconnect(struct nut_client *c) {
+    if (c->ndpl)
+        nd_poll_destroy(c->ndpl);
+    c->ndpl = NULL;
+
+    buffer_free(c->wb);
+    c->wb = NULL;
+
+    nd_sock_close(&c->sock);
+}
+
+// Queues the query 'LIST <type> [<ups name>]'. Nothing is written until the responses are read.
+static void nut_client_request_list(struct nut_client *c, const char *type, const char *ups_name) {
+    size_t len = buffer_strlen(c->wb);
+
+    buffer_fast_strcat(c->wb, "LIST ", 5);
+    buffer_strcat(c->wb, type);
+    if (ups_name) {
+        buffer_putc(c->wb, ' ');
+        buffer_strcat(c->wb, ups_name);
+    }
+    buffer_putc(c->wb, '\n');
+
+    if (nut_client_timed(c)) {
+        c->queued += buffer_strlen(c->wb) - len;
+        nut_client_query_queued(c);
+    }
+}
+
+// Reads the next chunk of the responses from the capture, as it was read from upsd. The
+// queued queries are discarded, since the capture already has their responses.
+static bool nut_client_replay(struct nut_client *c) {
+    buffer_flush(c->wb);
+    c->sent = 0;
+
+    if (c->rpos) {
+        memmove(c->rbuf, &c->rbuf[c->rpos], c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos = 0;
+    }
+
+    ssize_t bytes = nut_capture_read(&c->capture, NUT_CAPTURE_RECEIVED, &c->rbuf[c->rlen], sizeof(c->rbuf) - 1 - c->rlen);
+    if (bytes < 0)
+        return false;
+
+    c->rlen += bytes;
+    return true;
+}
+
+// Reads as much as it fits in the receive buffer, once the connection is readable.
+// Returns 1 if it read anything, 0 if it has to wait again, and -1 on failure.
+static int nut_client_read(struct nut_client *c) {
+    // Make room in the receive buffer, by discarding the lines already parsed.
+    if (c->rpos) {
+        memmove(c->rbuf, &c->rbuf[c->rpos], c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos = 0;
+    }
+
+    if (c->rlen == sizeof(c->rbuf) - 1) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    ssize_t bytes = nd_sock_revc_nowait(&c->sock, &c->rbuf[c->rlen], sizeof(c->rbuf) - 1 - c->rlen);
+    if (bytes == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (bytes < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+    if (nut_capture_recording(&c->capture))
+        nut_capture_write(&c->capture, NUT_CAPTURE_RECEIVED, &c->rbuf[c->rlen], bytes);
+    c->rlen += bytes;
+    return 1;
+}
+
+// Waits until the connection is readable, writing the queued queries meanwhile whenever
+// the connection is writable. Then, it reads as much as it fits in the receive buffer.
+static bool nut_client_receive(struct nut_client *c, usec_t deadline_ut) {
+    if (nut_capture_replaying(&c->capture))
+        return nut_client_replay(c);
+
+    for (;;) {
+        // TLS may have decrypted more than the previous read took, which the socket does not
+        // signal anymore.
+        if (unlikely(nd_sock_is_ssl(&c->sock) && netdata_ssl_has_pending(&c->sock.ssl))) {
+            int rc = nut_client_read(c);
+            if (rc)
+                return rc > 0;
+        }
+
+        bool pending = c->sent < buffer_strlen(c->wb);
+
+        if (!nd_poll_upd(c->ndpl, c->sock.fd, ND_POLL_READ | (pending ? ND_POLL_WRITE : 0)))
+            return false;
+
+        usec_t now_ut = now_monotonic_usec();
+        if (now_ut >= deadline_ut) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        nd_poll_result_t result;
+        int rc = nd_poll_wait(c->ndpl, (int)((deadline_ut - now_ut + USEC_PER_MS - 1) / USEC_PER_MS), &result);
+        if (rc == 0)
+            continue;
+        if (rc < 0 || (result.events & (ND_POLL_ERROR | ND_POLL_HUP | ND_POLL_INVALID)))
+            return false;
+
+        if (result.events & ND_POLL_WRITE) {
+            ssize_t bytes = nd_sock_send_nowait(&c->sock, &c->wb->buffer[c->sent], buffer_strlen(c->wb) - c->sent);
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return false;
+
+            if (bytes > 0) {
+                if (nut_capture_recording(&c->capture))
+                    nut_capture_write(&c->capture, NUT_CAPTURE_SENT, &c->wb->buffer[c->sent], bytes);
+                c->sent += bytes;
+                if (nut_client_timed(c)) {
+                    c->written += bytes;
+                    nut_client_query_written(c);
+                }
+                if (c->sent == buffer_strlen(c->wb)) {
+                    buffer_flush(c->wb);
+                    c->sent = 0;
+                }
+            }
+        }
+
+        if (result.events & ND_POLL_READ) {
+            int rc = nut_client_read(c);
+            if (rc)
+                return rc > 0;
+        }
+    }
+}
+
+// Reads the next line of the responses and splits it into c->words.
+static bool nut_client_read_line(struct nut_client *c, usec_t deadline_ut) {
+    char *eol;
+
+    while (!(eol = memchr(&c->rbuf[c->rpos], '\n', c->rlen - c->rpos)))
+        if (!nut_client_receive(c, deadline_ut))
+            return false;
+
+    *eol = '\0';
+    if (eol > &c->rbuf[c->rpos] && eol[-1] == '\r')
+        eol[-1] = '\0';
+
+    c->num_words = quoted_strings_splitter_whitespace(&c->rbuf[c->rpos], c->words, NUT_CLIENT_MAX_WORDS);
+    c->rpos = eol - c->rbuf + 1;
+    return true;
+}
+
+// Reads the first line of the response to a LIST query.
+// Returns 1 if the list begins, 0 if upsd responded with an error, and -1 on failure.
+static int nut_client_list_begin(struct nut_client *c, usec_t deadline_ut) {
+    if (!nut_client_read_line(c, deadline_ut))
+        return -1;
+
+    // BEGIN LIST <type> [<ups name>]
+    if (c->num_words >= 3 && streq(c->words[0], "BEGIN") && streq(c->words[1], "LIST"))
+        return 1;
+
+    // ERR <error code>
+    if (c->num_words >= 2 && streq(c->words[0], "ERR")) {
+        netdata_log_debug(D_SYSTEM, "upsd responded with error '%s'", c->words[1]);
+        if (nut_client_timed(c))
+            nut_client_query_responded(c);
+        return 0;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+// Reads the next item of the response to a LIST query into c->words.
+// Returns 1 for an item, 0 at the end of the list, and -1 on failure.
+static int nut_client_list_next(struct nut_client *c, usec_t deadline_ut) {
+    if (!nut_client_read_line(c, deadline_ut))
+        return -1;
+
+    // END LIST <type> [<ups name>]
+    if (c->num_words >= 2 && streq(c->words[0], "END") && streq(c->words[1], "LIST")) {
+        if (nut_client_timed(c))
+            nut_client_query_responded(c);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Reads the variables of the response to a 'LIST VAR <ups name>' query into the snapshot,
+// keeping only the ones which are indexed in nd_nut_vars. Returns false on failure.
+static bool nut_client_read_vars(struct nut_client *c, struct nut_snapshot *snap, usec_t deadline_ut) {
+    int rc;
+
+    memset(snap->present, 0, sizeof(snap->present));
+
+    while ((rc = nut_client_list_next(c, deadline_ut)) == 1) {
+        // VAR <ups name> <variable name> "<variable value>"
+        if (c->num_words < 4)
+            continue;
+
+        size_t index = (size_t)dictionary_get(nd_nut_vars, c->words[2]);
+        if (!index)
+            continue;
+
+        strncpyz(snap->value[index - 1], c->words[3], BUFLEN - 1);
+        snap->present[index - 1] = true;
+    }
+
+    return rc == 0;
+}
+
+// ----------------------------------------------------------------------------
+// upsd servers
+//
+// Every upsd server is collected by its own thread, with its own connections and UPS
+// index, so that a slow or unreachable server never delays the others. Each
+// thread formats its output into its own buffer, and writes it to stdout once per tick
+// while holding stdout_mutex.
+
+#define UPSD_CONFIG_FILENAME "upsd.conf"
+#define UPSD_DEFAULT_HOST    "127.0.0.1"
+#define UPSD_DEFAULT_PORT    3493
+
+// The delay before reconnecting to a upsd server doubles after every failed attempt, within
+// these bounds.
+#define UPSD_RECONNECT_MIN_SEC 1
+#define UPSD_RECONNECT_MAX_SEC 300
+
+struct upsd_server {
+    char *name;  // the name given in upsd.conf, or NULL for the default (local) server
+    char *host;
+    int port;
+
+    ND_THREAD *thread;
+    int exit_code;
+    heartbeat_t hb;
+    size_t tick; // it keeps counting across reconnections, for the schedules of the UPSes
+    size_t sample; // the sample of the current tick, in the sub-second mode
+    usec_t tick_dt;
+    usec_t tick_started_ut; // when the heartbeat of the current tick woke up
+
+    struct nut_client nut; // the connection used to register and collect the UPSes
+    struct nut_snapshot snapshot;
+
+    // Hash table mapping UPS name to its struct upsd_ups, which is allocated from ups_aral.
+    DICTIONARY *ups;
+    ARAL *ups_aral;
+
+    // The number of the UPSes which the most recent 'LIST UPS' query listed and which we
+    // know of. While it matches the number of the entries of ups, none of them are gone.
+    size_t listed;
+
+    // The names of the UPSes which are new to us, in the order of their probes in the
+    // current sample.
+    char (*probes)[BUFLEN];
+    size_t probes_used;
+    size_t probes_size;
+
+    BUFFER *out;
+
+    // How long the registration of a UPS took, most recently and at most.
+    usec_t registration_last_ut;
+    usec_t registration_max_ut;
+
+    // The delay before the next attempt to connect, when the current outage started (or 0
+    // if upsd is connected), how long the previous outage lasted, and how many there were.
+    usec_t backoff_ut;
+    usec_t outage_started_ut;
+    usec_t outage_last_ut;
+    uint64_t reconnects;
+
+    // The UPSes of the server, for the ups-inventory function, which runs on the functions
+    // worker thread. The list, and the inventory of its UPSes, are only accessed while
+    // holding inventory_spinlock.
+    SPINLOCK inventory_spinlock;
+    struct upsd_ups *inventory;
+
+    // The memory which the collection of the server takes, besides that of ups_aral: the
+    // bytes of all of its buffers, and the statistics of the ups dictionary.
+    size_t buffers_bytes;
+    struct dictionary_stats ups_stats;
+
+    // The self telemetry, which is only kept when self_telemetry is enabled: the thread id
+    // for the worker utilization, the number of queries sent to upsd (their response times
+    // are kept by the nut client), how long the UPSes of the current tick took to be
+    // collected once upsd responded, the bytes written to stdout, and how late the heartbeat
+    // was during the current tick.
+    pid_t tid;
+    uint64_t requests;
+    usec_t collection_sum_ut;
+    usec_t collection_max_ut;
+    size_t collections;
+    uint64_t output_bytes;
+    usec_t lateness_max_ut;
+
+    struct upsd_server *prev, *next;
+};
+
+// The jobs of the worker of a upsd server thread, which tell apart the time spent waiting
+// for upsd from the time spent by the plugin.
+#define WORKER_UPSD_JOB_QUERY    0
+#define WORKER_UPSD_JOB_REGISTER 1
+#define WORKER_UPSD_JOB_COLLECT  2
+#define WORKER_UPSD_JOB_FLUSH    3
+#define WORKER_UPSD_JOBS         4
+
+static const char *worker_upsd_job_names[WORKER_UPSD_JOBS] = {
+    [WORKER_UPSD_JOB_QUERY]    = "query",
+    [WORKER_UPSD_JOB_REGISTER] = "register",
+    [WORKER_UPSD_JOB_COLLECT]  = "collect",
+    [WORKER_UPSD_JOB_FLUSH]    = "flush",
+};
+
+// The list is only changed before the collector threads start and after they end; the
+// functions worker thread and the telemetry thread walk it while holding upsd_servers_mutex.
+static struct upsd_server *upsd_servers;
+static netdata_mutex_t upsd_servers_mutex = NETDATA_MUTEX_INITIALIZER;
+
+// The agent caches the charts of the plugin by their slot, so that it does not have to look
+// them up by their id. The slots of the charts of a UPS are numbered from the slot of its
+// status chart onwards, in the order of the indices of the charts in struct nut_snapshot,
+// so that a UPS only takes as many slots as it has charts. The dimensions of a chart are
+// numbered from 1, in the order that they are defined. Chart slots must be unique across
+// all of the upsd servers. The slots of a UPS which is removed are reused by the UPSes which
+// are registered later, so that they do not grow with UPS churn; this is safe, because the
+// agent binds a slot to a chart whenever a CHART line names it.
+struct chart_slots_range {
+    uint32_t first;
+    uint32_t count;
+};
+
+static struct {
+    netdata_mutex_t mutex;
+    uint32_t next; // the first slot which was never reserved
+
+    // The slots of the UPSes which were removed.
+    struct chart_slots_range *released;
+    size_t released_used;
+    size_t released_size;
+} chart_slots = {
+    .mutex = NETDATA_MUTEX_INITIALIZER,
+    .next = 1,
+};
+
+static uint32_t chart_slots_reserve(uint32_t count) {
+    uint32_t first;
+
+    netdata_mutex_lock(&chart_slots.mutex);
+
+    for (size_t i = 0; i < chart_slots.released_used; i++) {
+        struct chart_slots_range *range = &chart_slots.released[i];
+        if (range->count < count)
+            continue;
+
+        first = range->first;
+        range->first += count;
+        range->count -= count;
+        if (!range->count)
+            *range = chart_slots.released[--chart_slots.released_used];
+
+        netdata_mutex_unlock(&chart_slots.mutex);
+        return first;
+    }
+
+    first = chart_slots.next;
+    chart_slots.next += count;
+
+    netdata_mutex_unlock(&chart_slots.mutex);
+    return first;
+}
+
+static void chart_slots_release(uint32_t first, uint32_t count) {
+    netdata_mutex_lock(&chart_slots.mutex);
+
+    if (chart_slots.released_used == chart_slots.released_size) {
+        chart_slots.released_size = chart_slots.released_size ? chart_slots.released_size * 2 : 16;
+        chart_slots.released = reallocz(chart_slots.released, chart_slots.released_size * sizeof(*chart_slots.released));
+    }
+
+    chart_slots.released[chart_slots.released_used++] = (struct chart_slots_range){ .first = first, .count = count };
+
+    netdata_mutex_unlock(&chart_slots.mutex);
+}
+
+// The charts which are derived from the variables of a UPS, rather than charted from one:
+// the energy which went through it, integrated from its power, its efficiency, from its
+// input and output power, and the time until its battery is empty, from the rate at which
+// its battery charge drops.
+enum ups_derived {
+    UPS_DERIVED_ENERGY,
+    UPS_DERIVED_EFFICIENCY,
+    UPS_DERIVED_TIME_TO_EMPTY,
+    UPS_DERIVED_CHARTS,
+};
+
+static const struct {
+    const char *chart_id;
+    const char *chart_title;
+    const char *chart_units;
+    const char *chart_family;
+    const char *chart_context;
+    const char *chart_type;
+    unsigned int chart_priority;
+    const char *algorithm;
+    unsigned int divisor; // 0 for the values which are sent with send_SET_value()
+    const char *dimensions[2];
+} ups_derived_charts[UPS_DERIVED_CHARTS] = {
+    [UPS_DERIVED_ENERGY] = {
+        "energy", "UPS energy", "Wh", "ups", "upsd.ups_energy", "line",
+        NETDATA_CHART_PRIO_UPSD_ENERGY, "absolute", 1000, { "output", "input" },
+    },
+    [UPS_DERIVED_EFFICIENCY] = {
+        "efficiency", "UPS efficiency", "percentage", "ups", "upsd.ups_efficiency", "line",
+        NETDATA_CHART_PRIO_UPSD_EFFICIENCY, "absolute", 0, { "efficiency", NULL },
+    },
+    [UPS_DERIVED_TIME_TO_EMPTY] = {
+        "time_to_empty", "UPS forecast time to empty battery", "seconds", "battery", "upsd.ups_time_to_empty", "line",
+        NETDATA_CHART_PRIO_UPSD_TIME_TO_EMPTY, "absolute", 1, { "time_to_empty", NULL },
+    },
+};
+
+// The battery charge drops by whole percents, so most collections see no drop at all, and
+// its rate is fitted over up to this many collections since the discharge started.
+#define UPS_DISCHARGE_POINTS 60
+
+// A line prefix of the output, within the text of a struct ups_frame.
+struct ups_frame_span {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// The line prefixes of a charted variable of a UPS.
+struct ups_frame_chart {
+    // BEGIN SLOT:<slot> upsd_<ups>.<chart>
+    // It is empty for the members of a template but the first one, which share its chart.
+    struct ups_frame_span begin;
+
+    // SET SLOT:<n> <dimension> =
+    struct ups_frame_span set;
+};
+
+// The parts of the output of a UPS which are the same on every tick. They are formatted once,
+// when the UPS is registered, so that every tick only has to write the timestamps and values.
+struct ups_frame {
+    // BEGIN SLOT:<slot> upsd_<ups>.status
+    struct ups_frame_span status_begin;
+
+    // SET SLOT:<n> <status dimension> =
+    struct ups_frame_span status_set[LENGTHOF(ups_status_dimensions)];
+
+    // One per charted variable of the UPS, in the order of their indices, i.e. of the bits of
+    // the bitmap of its charts, so that it is sized by the charts which the UPS has.
+    struct ups_frame_chart *charts;
+    size_t charts_count;
+
+    // HOST <machine guid of the virtual node of the UPS>
+    struct ups_frame_span host;
+
+    // BEGIN SLOT:<slot> upsd_<ups>.<derived chart>
+    // SET SLOT:<n> <derived dimension> =
+    struct ups_frame_span derived_begin[UPS_DERIVED_CHARTS];
+    struct ups_frame_span derived_set[UPS_DERIVED_CHARTS][2];
+
+    BUFFER *text;
+};
+
+static void ups_frame_add_begin(struct ups_frame *frame, struct ups_frame_span *span, uint32_t slot, const char *type, const char *name) {
+    span->offset = buffer_strlen(frame->text);
+    buffer_fast_strcat(frame->text, "BEGIN SLOT:", 11);
+    buffer_print_uint64_encoded(frame->text, NETDATA_PLUGIN_ENCODING, slot);
+    buffer_fast_strcat(frame->text, " upsd_", 6);
+    buffer_strcat(frame->text, type);
+    buffer_putc(frame->text, '.');
+    buffer_strcat(frame->text, name);
+    buffer_putc(frame->text, ' ');
+    span->length = buffer_strlen(frame->text) - span->offset;
+}
+
+static void ups_frame_add_set(struct ups_frame *frame, struct ups_frame_span *span, uint32_t slot, const char *name) {
+    span->offset = buffer_strlen(frame->text);
+    buffer_fast_strcat(frame->text, "SET SLOT:", 9);
+    buffer_print_uint64_encoded(frame->text, NETDATA_PLUGIN_ENCODING, slot);
+    buffer_putc(frame->text, ' ');
+    buffer_strcat(frame->text, name);
+    buffer_fast_strcat(frame->text, " = ", 3);
+    span->length = buffer_strlen(frame->text) - span->offset;
+}
+
+// The frame of a UPS with the given number of charted variables, which are accounted in
+// 'statistics', along with its text.
+static void ups_frame_init(struct ups_frame *frame, const char *clean_ups_name, uint32_t slot, size_t charts, size_t *statistics) {
+    frame->text = buffer_create(2048, statistics);
+    frame->charts = callocz(charts, sizeof(*frame->charts));
+    frame->charts_count = charts;
+    __atomic_add_fetch(statistics, charts * sizeof(*frame->charts), __ATOMIC_RELAXED);
+
+    ups_frame_add_begin(frame, &frame->status_begin, slot, clean_ups_name, "status");
+    for (size_t i = 0; i < LENGTHOF(ups_status_dimensions); i++)
+        ups_frame_add_set(frame, &frame->status_set[i], i + 1, ups_status_dimensions[i]);
+}
+
+static void ups_frame_add_derived(struct ups_frame *frame, const char *clean_ups_name, enum ups_derived derived, uint32_t slot) {
+    ups_frame_add_begin(frame, &frame->derived_begin[derived], slot, clean_ups_name, ups_derived_charts[derived].chart_id);
+    for (size_t i = 0; i < 2 && ups_derived_charts[derived].dimensions[i]; i++)
+        ups_frame_add_set(frame, &frame->derived_set[derived][i], i + 1, ups_derived_charts[derived].dimensions[i]);
+}
+
+static void ups_frame_cleanup(struct ups_frame *frame, size_t *statistics) {
+    __atomic_sub_fetch(statistics, frame->charts_count * sizeof(*frame->charts), __ATOMIC_RELAXED);
+    freez(frame->charts);
+    frame->charts = NULL;
+    frame->charts_count = 0;
+
+    buffer_free(frame->text);
+    frame->text = NULL;
+}
+
+// ----------------------------------------------------------------------------
+// UPSes
+
+// The battery charge of a UPS as of its collections since its battery started discharging,
+// oldest first, with the seconds since then. Only every 'every' collections are kept, so
+// that the points span the whole discharge: whenever they are all taken, every other one
+// is dropped, and they are taken half as often from then on.
+struct ups_discharge {
+    usec_t started_ut;
+    NETDATA_DOUBLE time_s[UPS_DISCHARGE_POINTS];
+    NETDATA_DOUBLE charge[UPS_DISCHARGE_POINTS];
+    size_t used;
+    size_t every;
+    size_t skipped;
+};
+
+static void ups_discharge_add(struct ups_discharge *d, usec_t now_ut, NETDATA_DOUBLE charge) {
+    if (!d->used) {
+        d->started_ut = now_ut;
+        d->every = 1;
+        d->skipped = 0;
+    }
+    else if (++d->skipped < d->every)
+        return;
+
+    d->skipped = 0;
+
+    if (d->used == UPS_DISCHARGE_POINTS) {
+        for (size_t i = 0; i < UPS_DISCHARGE_POINTS / 2; i++) {
+            d->time_s[i] = d->time_s[2 * i];
+            d->charge[i] = d->charge[2 * i];
+        }
+        d->used = UPS_DISCHARGE_POINTS / 2;
+        d->every *= 2;
+    }
+
+    d->time_s[d->used] = (NETDATA_DOUBLE)(now_ut - d->started_ut) / USEC_PER_SEC;
+    d->charge[d->used++] = charge;
+}
+
+// Forecasts the time until the battery is empty, from the least-squares line of its charge
+// over the discharge. Returns false until the charge has dropped.
+static bool ups_discharge_forecast(const struct ups_discharge *d, usec_t now_ut, NETDATA_DOUBLE *time_to_empty) {
+    NETDATA_DOUBLE time_mean = 0, charge_mean = 0, covariance = 0, variance = 0;
+
+    if (d->used < 2)
+        return false;
+
+    for (size_t i = 0; i < d->used; i++) {
+        time_mean += d->time_s[i];
+        charge_mean += d->charge[i];
+    }
+    time_mean /= d->used;
+    charge_mean /= d->used;
+
+    for (size_t i = 0; i < d->used; i++) {
+        covariance += (d->time_s[i] - time_mean) * (d->charge[i] - charge_mean);
+        variance += (d->time_s[i] - time_mean) * (d->time_s[i] - time_mean);
+    }
+
+    NETDATA_DOUBLE slope = variance > 0 ? covariance / variance : 0;
+    if (slope >= 0)
+        return false;
+
+    // The charge now is taken from the line as well, rather than from the last collection,
+    // which is off by up to a whole percent.
+    NETDATA_DOUBLE now_s = (NETDATA_DOUBLE)(now_ut - d->started_ut) / USEC_PER_SEC;
+    NETDATA_DOUBLE charge = charge_mean + slope * (now_s - time_mean);
+
+    *time_to_empty = charge > 0 ? charge / -slope : 0;
+    return true;
+}
+
+// The samples of a chart of a UPS in the current tick, in the sub-second mode, and the
+// prefixes of the lines of its minimum and maximum dimensions. The average takes the one
+// dimension of the chart.
+struct ups_aggregate {
+    NETDATA_DOUBLE min;
+    NETDATA_DOUBLE max;
+    NETDATA_DOUBLE sum;
+    size_t count;
+
+    // SET SLOT:2 <dimension>_min =
+    struct ups_frame_span set_min;
+
+    // SET SLOT:3 <dimension>_max =
+    struct ups_frame_span set_max;
+};
+
+// The samples of a UPS in the current tick, in the sub-second mode: how many samples had
+// each status, and one struct ups_aggregate per chart of the UPS, in the order of their
+// indices.
+struct ups_samples {
+    size_t count;
+    uint32_t status[LENGTHOF(ups_status_dimensions)];
+    struct ups_aggregate charts[];
+};
+
+// The state of a UPS of a upsd server. It is of fixed size, so that it can be allocated
+// from an ARAL, and what depends on the charts of the UPS or on its battery discharging is
+// allocated apart, to the size that the UPS needs.
+struct upsd_ups {
+    // The 'cleaned' (normalized) version of the UPS name which is suitable for use in
+    // NetData. The UPSes of a named server are prefixed with the name of the server, so
+    // that UPS names may be reused across servers.
+    char clean_name[2 * BUFLEN];
+
+    // Bitmap of the indices of the charts which the UPS supports.
+    uint64_t charts[NUT_VARS_BITMAP_WORDS];
+
+    // The tick of the most recent 'LIST UPS' query which listed the UPS.
+    size_t seen_tick;
+
+    // When the static charts were last sent, or 0 if they have not been sent yet.
+    usec_t static_collected_ut;
+
+    // The collection schedule of the UPS: the tick of its next 'LIST VAR' query, whether it
+    // is collected on every tick because of a power event, and the tick time of its most
+    // recent collection.
+    size_t next_tick;
+    bool fast;
+    usec_t collected_ut;
+
+    // The most recent 'ups.status' variable, and its parsed bitmask of enum nut_ups_status.
+    char status_string[BUFLEN];
+    uint32_t status;
+
+    // The values of ups_labels[], fetched once when the UPS is registered. An empty
+    // string means that the UPS does not have the variable.
+    char labels[LENGTHOF(ups_labels)][BUFLEN];
+
+    // The chart slots of the UPS.
+    uint32_t slot;
+    uint32_t slots;
+
+    // The samples of the current tick, or NULL unless in the sub-second mode.
+    struct ups_samples *samples;
+
+    // The bitmap of the enum ups_derived charts of the UPS, which follow its other charts,
+    // and their state: the energy of the output and of the input in Wh, since the UPS was
+    // registered, the power of the previous collection, and the battery charge of the
+    // current discharge, which is only allocated while the battery discharges.
+    uint32_t derived;
+    struct {
+        NETDATA_DOUBLE output_wh;
+        NETDATA_DOUBLE input_wh;
+        NETDATA_DOUBLE output_w;
+        NETDATA_DOUBLE input_w;
+        struct ups_discharge *discharge;
+    } energy;
+
+    struct ups_frame frame;
+
+    // The name of the UPS on its upsd server.
+    char name[BUFLEN];
+
+    // What the ups-inventory function shows of the UPS, as of the most recent tick. The
+    // labels above do not change after registration, so they need no copy.
+    struct {
+        uint32_t status;
+        NETDATA_DOUBLE charge;
+        NETDATA_DOUBLE runtime;
+        NETDATA_DOUBLE load;
+    } inventory;
+
+    struct upsd_ups *prev, *next;
+};
+
+static bool fast_ups_acquire(void) {
+    size_t used = __atomic_load_n(&fast_ups_used, __ATOMIC_RELAXED);
+
+    do {
+        if (used >= fast_ups_max)
+            return false;
+    } while (!__atomic_compare_exchange_n(&fast_ups_used, &used, used + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+static void fast_ups_release(void) {
+    __atomic_sub_fetch(&fast_ups_used, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long ups_update_every(const struct upsd_ups *ups) {
+    return ups->fast ? netdata_update_every : (unsigned long)steady_update_every;
+}
+
+static void upsd_ups_free(struct upsd_server *srv, struct upsd_ups *ups) {
+    if (ups->fast)
+        fast_ups_release();
+
+    spinlock_lock(&srv->inventory_spinlock);
+    DOUBLE_LINKED_LIST_REMOVE_ITEM_UNSAFE(srv->inventory, ups, prev, next);
+    spinlock_unlock(&srv->inventory_spinlock);
+
+    if (!virtual_nodes)
+        chart_slots_release(ups->slot, ups->slots);
+    freez(ups->samples);
+    freez(ups->energy.discharge);
+    ups_frame_cleanup(&ups->frame, &srv->buffers_bytes);
+    aral_freez(srv->ups_aral, ups);
+}
+
+static inline void send_span(BUFFER *wb, const struct ups_frame *frame, const struct ups_frame_span *span) {
+    buffer_fast_strcat(wb, &frame->text->buffer[span->offset], span->length);
+}
+
+static inline void send_BEGIN_span(BUFFER *wb, const struct ups_frame *frame, const struct ups_frame_span *span, usec_t usec) {
+    send_span(wb, frame, span);
+    buffer_print_uint64(wb, usec);
+    buffer_putc(wb, '\n');
+}
+
+static inline void send_SET(BUFFER *wb, const struct ups_frame *frame, const struct ups_frame_span *span, int64_t value) {
+    send_span(wb, frame, span);
+    buffer_print_int64_encoded(wb, NETDATA_PLUGIN_ENCODING, value);
+    buffer_putc(wb, '\n');
+}
+
+// Sends a value in the fixed point of value_precision, rounded to the nearest, rather than
+// truncated towards zero, so that the error is at most half of the last decimal digit.
+static inline void send_SET_value(BUFFER *wb, const struct ups_frame *frame, const struct ups_frame_span *span, NETDATA_DOUBLE value) {
+    send_SET(wb, frame, span, (int64_t)llrint(value * value_precision));
+}
+
+static inline void send_END(BUFFER *wb) {
+    buffer_fast_strcat(wb, "END\n", 4);
+}
+
+// Parses the 'ups.status' variable into the bitmask of enum nut_ups_status. The status is
+// only parsed again when it differs from that of the previous collection.
+static void ups_status_update(struct upsd_ups *ups, const struct nut_snapshot *snap) {
+    const char *ups_status_string = nut_snapshot_get(snap, NUT_VAR_UPS_STATUS);
+
+    if (!ups_status_string)
+        ups_status_string = "";
+
+    if (unlikely(strcmp(ups->status_string, ups_status_string) != 0)) {
+        strncpyz(ups->status_string, ups_status_string, BUFLEN - 1);
+        ups->status = nut_ups_status_parse(ups_status_string);
+    }
+}
+
+// Emits the Netdata metrics for each status, printing 1 for each set status and 0
+// otherwise. In the sub-second mode, the metric of each status is the fraction of the
+// samples of the tick which had it.
+static void send_metric_ups_status(BUFFER *wb, const struct upsd_ups *ups, usec_t dt) {
+    const struct ups_frame *frame = &ups->frame;
+    const struct ups_samples *samples = ups->samples;
+
+    send_BEGIN_span(wb, frame, &frame->status_begin, dt);
+    for (size_t i = 0; i < LENGTHOF(ups_status_dimensions); i++) {
+        if (samples && samples->count)
+            send_SET_value(wb, frame, &frame->status_set[i], (NETDATA_DOUBLE)samples->status[i] / samples->count);
+        else
+            send_SET(wb, frame, &frame->status_set[i], ((ups->status >> i) & 1) * value_precision);
+    }
+    send_END(wb);
+}
+
+// The value of a chart of a UPS, in its units. The 'ups.realpower' chart is a special case,
+// because if the variable is not available, then it can be calculated from the 'ups.load'
+// and 'ups.realpower.nominal' variables.
+static bool nut_snapshot_chart_value(const struct nut_snapshot *snap, size_t index, NETDATA_DOUBLE *value) {
+    const char *s = nut_snapshot_get(snap, index);
+
+    if (likely(s)) {
+        *value = str2ndd(s, NULL);
+        return true;
+    }
+
+    if (index != nut_chart_realpower)
+        return false;
+
+    const char *load = nut_snapshot_get(snap, nut_chart_load);
+    const char *nominal = nut_snapshot_get(snap, NUT_VAR_UPS_REALPOWER_NOMINAL);
+    if (!load || !nominal)
+        return false;
+
+    *value = str2ndd(load, NULL) / 100 * str2ndd(nominal, NULL);
+    return true;
+}
+
+// Labels the chart which was just defined with the labels of the UPS.
+static void send_ups_labels(struct upsd_server *srv, const struct upsd_ups *ups, const char *ups_name) {
+    // CLABEL name value source
+    for (size_t i = 0; i < LENGTHOF(ups_labels); i++)
+        if (*ups->labels[i])
+            buffer_sprintf(srv->out, "CLABEL '%s' '%s' %u\n", ups_labels[i].label, ups->labels[i], NETDATA_CLABEL_SOURCE_AUTO);
+
+    // CLABEL_COMMIT
+    buffer_sprintf(srv->out, "CLABEL 'ups_name' '%s' %u\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n",
+           ups_name, NETDATA_CLABEL_SOURCE_AUTO,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+}
+
+// Defines the virtual node of a UPS, which the charts of the UPS that follow belong to. Its
+// machine guid is derived from the upsd server and the name of the UPS, so that the node
+// is the same across restarts of the plugin. Each UPS has the chart slots of its node to
+// itself, so they are numbered from 1.
+static void send_ups_host(struct upsd_server *srv, struct upsd_ups *ups, const char *ups_name) {
+    char key[2 * BUFLEN + 64];
+    char guid[UUID_STR_LEN];
+
+    snprintfz(key, sizeof(key), "upsd:%s:%d:%s", srv->host, srv->port, ups_name);
+    ND_UUID uuid = UUID_generate_from_hash(key, strlen(key));
+    nd_uuid_unparse_lower(uuid.uuid, guid);
+
+    // HOST_DEFINE machine_guid hostname
+    buffer_sprintf(srv->out, "HOST_DEFINE '%s' '%s'\n", guid, ups->clean_name);
+
+    // HOST_LABEL key value
+    for (size_t i = 0; i < LENGTHOF(ups_labels); i++)
+        if (*ups->labels[i])
+            buffer_sprintf(srv->out, "HOST_LABEL '%s' '%s'\n", ups_labels[i].label, ups->labels[i]);
+    buffer_sprintf(srv->out, "HOST_LABEL 'ups_name' '%s'\n"
+           "HOST_LABEL 'upsd_server' '%s:%d'\n"
+           "HOST_LABEL '_virtualization' 'ups'\n"
+           "HOST_DEFINE_END\n",
+           ups_name, srv->host, srv->port);
+
+    ups->frame.host.offset = buffer_strlen(ups->frame.text);
+    buffer_sprintf(ups->frame.text, "HOST %s\n", guid);
+    ups->frame.host.length = buffer_strlen(ups->frame.text) - ups->frame.host.offset;
+}
+
+// The charts of a UPS are collected every ups_update_every(), except for the static ones.
+// The options are empty, unless the charts are being marked obsolete.
+static void send_ups_status_chart(BUFFER *wb, const struct upsd_ups *ups, const char *options) {
+    // CHART [SLOT:slot] type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
+    buffer_sprintf(wb, "CHART SLOT:%u 'upsd_%s.status' '' 'UPS status' 'status' 'ups' 'upsd.ups_status' 'line' %u %lu '%s' '" PLUGIN_UPSD_NAME "'\n",
+           ups->slot, ups->clean_name, NETDATA_CHART_PRIO_UPSD_UPS_STATUS, ups_update_every(ups), options);
+}
+
+static void send_ups_chart(BUFFER *wb, const struct upsd_ups *ups, const struct nd_chart *chart, uint32_t slot, const char *options) {
+    // CHART [SLOT:slot] type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
+    buffer_sprintf(wb, "CHART SLOT:%u 'upsd_%s.%s' '' '%s' '%s' '%s' '%s' '%s' '%u' '%lu' '%s' '" PLUGIN_UPSD_NAME "'\n",
+           slot,                  // slot
+           ups->clean_name, chart->chart_id, // type.id
+           chart->chart_title,    // title
+           chart->chart_units,    // units
+           chart->chart_family,   // family
+           chart->chart_context,  // context
+           chart->chart_type,     // charttype
+           chart->chart_priority, // priority
+           chart->is_static ? (unsigned long)static_update_every : ups_update_every(ups), // update_every
+           options);              // options
+}
+
+// Takes a variable of a UPS which is being registered: a label, or a chart.
+static void register_ups_var(struct upsd_ups *ups, const char *name, const char *value) {
+    for (size_t i = 0; i < LENGTHOF(ups_labels); i++)
+        if (streq(name, ups_labels[i].nut_variable))
+            strncpyz(ups->labels[i], value, BUFLEN - 1);
+
+    size_t index = nut_vars_index_resolve(name, value);
+    if (index)
+        nut_vars_bitmap_set(ups->charts, index - 1);
+}
+
+// Reads the variables of a UPS which is being registered, from the response to the
+// 'LIST VAR' query which probed it. The one query tells which variables the UPS supports,
+// along with the values of its labels. Returns false on failure.
+static bool register_ups_vars(struct upsd_server *srv, struct upsd_ups *ups, usec_t deadline_ut) {
+    int rc;
+
+    // VAR <ups name> <variable name> "<variable value>"
+    while ((rc = nut_client_list_next(&srv->nut, deadline_ut)) == 1)
+        if (srv->nut.num_words >= 4)
+            register_ups_var(ups, srv->nut.words[2], srv->nut.words[3]);
+
+    return rc == 0;
+}
+
+static void send_ups_derived_chart(BUFFER *wb, const struct upsd_ups *ups, enum ups_derived derived, uint32_t slot, const char *options) {
+    // CHART [SLOT:slot] type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
+    buffer_sprintf(wb, "CHART SLOT:%u 'upsd_%s.%s' '' '%s' '%s' '%s' '%s' '%s' '%u' '%lu' '%s' '" PLUGIN_UPSD_NAME "'\n",
+           slot,
+           ups->clean_name, ups_derived_charts[derived].chart_id,
+           ups_derived_charts[derived].chart_title,
+           ups_derived_charts[derived].chart_units,
+           ups_derived_charts[derived].chart_family,
+           ups_derived_charts[derived].chart_context,
+           ups_derived_charts[derived].chart_type,
+           ups_derived_charts[derived].chart_priority,
+           ups_update_every(ups),
+           options);
+}
+
+// The energy of the input is only charted along with the efficiency, i.e. if the UPS
+// reports the power of its input.
+static inline size_t ups_derived_dimensions(const struct upsd_ups *ups, enum ups_derived derived) {
+    if (derived == UPS_DERIVED_ENERGY && !(ups->derived & (1 << UPS_DERIVED_EFFICIENCY)))
+        return 1;
+    return ups_derived_charts[derived].dimensions[1] ? 2 : 1;
+}
+
+// The dimensions of the charts of a UPS, which follow their CHART and CLABEL lines, both when
+// the UPS is registered and when its charts are defined again.
+static void send_ups_status_dimensions(BUFFER *wb) {
+    // DIMENSION [SLOT:slot] id [name [algorithm [multiplier [divisor [options]]]]]
+    for (size_t i = 0; i < LENGTHOF(ups_status_dimensions); i++)
+        buffer_sprintf(wb, "DIMENSION SLOT:%zu %s '' '' '' %u\n", i + 1, ups_status_dimensions[i], value_precision);
+}
+
+// The dimensions of a charted variable, from dimension_slot onwards, which it is advanced
+// past: in the sub-second mode, the dimension is the average of the samples of the tick, and
+// their minimum and maximum get dimensions of their own.
+static void send_ups_var_dimensions(BUFFER *wb, const struct upsd_ups *ups, const struct nd_chart *chart, uint32_t *dimension_slot) {
+    // DIMENSION [SLOT:slot] id [name [algorithm [multiplier [divisor [options]]]]]
+    buffer_sprintf(wb, "DIMENSION SLOT:%u '%s' '' '' '' %u\n", (*dimension_slot)++, chart->chart_dimension, value_precision);
+
+    if (ups->samples && !nd_chart_of(chart)->is_static) {
+        buffer_sprintf(wb, "DIMENSION SLOT:%u '%s_min' '%s' '' '' %u\n", (*dimension_slot)++,
+                       chart->chart_dimension, chart->group ? "" : "min", value_precision);
+        buffer_sprintf(wb, "DIMENSION SLOT:%u '%s_max' '%s' '' '' %u\n", (*dimension_slot)++,
+                       chart->chart_dimension, chart->group ? "" : "max", value_precision);
+    }
+}
+
+static void send_ups_derived_dimensions(BUFFER *wb, const struct upsd_ups *ups, enum ups_derived derived) {
+    // DIMENSION [SLOT:slot] id [name [algorithm [multiplier [divisor [options]]]]]
+    for (size_t i = 0; i < ups_derived_dimensions(ups, derived); i++)
+        buffer_sprintf(wb, "DIMENSION SLOT:%zu '%s' '' '%s' 1 %u\n", i + 1,
+                       ups_derived_charts[derived].dimensions[i],
+                       ups_derived_charts[derived].algorithm,
+                       ups_derived_charts[derived].divisor ? ups_derived_charts[derived].divisor : value_precision);
+}
+
+// Registers a new UPS, once upsd has responded to its probe with the beginning of the list
+// of its variables. Returns NULL on failure.
+static struct upsd_ups *register_ups(struct upsd_server *srv, const char *ups_name, usec_t deadline_ut) {
+    usec_t started_ut = now_monotonic_usec();
+    struct upsd_ups *ups = aral_callocz(srv->ups_aral);
+    const char *clean_ups_name = ups->clean_name;
+    uint32_t slot, count = 1, dimension_slot = 1;
+    size_t rank = 0, variables = 0;
+    const struct nd_chart *group = NULL;
+
+    worker_is_busy(WORKER_UPSD_JOB_REGISTER);
+
+    if (srv->name)
+        snprintfz(ups->clean_name, sizeof(ups->clean_name), "%s_%s", srv->name, ups_name);
+    else
+        strncpyz(ups->clean_name, ups_name, sizeof(ups->clean_name) - 1);
+    clean_name(ups->clean_name);
+    strncpyz(ups->name, ups_name, sizeof(ups->name) - 1);
+
+    netdata_log_info("Registering UPS '%s' of upsd at %s:%d for Netdata metric collection", ups_name, srv->host, srv->port);
+
+    // The mapping of the variables to the charts is resolved here, once, so that the
+    // collection of every tick only reads the indexed variables.
+    if (unlikely(!register_ups_vars(srv, ups, deadline_ut))) {
+        aral_freez(srv->ups_aral, ups);
+        return NULL;
+    }
+
+    dictionary_set(srv->ups, ups_name, ups, 0);
+
+    // If the UPS does not support the 'ups.realpower' variable, then we can still
+    // calculate the load usage if the 'ups.load' and 'ups.realpower.nominal' variables
+    // are available.
+    if (nut_vars_bitmap_get(ups->charts, nut_chart_load) && nut_vars_bitmap_get(ups->charts, NUT_VAR_UPS_REALPOWER_NOMINAL))
+        nut_vars_bitmap_set(ups->charts, nut_chart_realpower);
+
+    // The derived charts only need the variables, whether or not they are charted.
+    if (nut_vars_bitmap_get(ups->charts, nut_chart_realpower))
+        ups->derived |= 1 << UPS_DERIVED_ENERGY;
+    if (nut_vars_bitmap_get(ups->charts, nut_chart_realpower) && nut_vars_bitmap_get(ups->charts, nut_chart_input_realpower))
+        ups->derived |= 1 << UPS_DERIVED_EFFICIENCY;
+    if (nut_vars_bitmap_get(ups->charts, nut_chart_charge))
+        ups->derived |= 1 << UPS_DERIVED_TIME_TO_EMPTY;
+
+    // Keep only the variables which are charted, and count their charts: the members of a
+    // template share one.
+    for (size_t index = 0; index < NUT_VAR_MAX; index++) {
+        if (!nut_vars_bitmap_get(ups->charts, index))
+            continue;
+        if (index < NUT_VAR_CHARTS || !nut_charts[index]) {
+            nut_vars_bitmap_clear(ups->charts, index);
+            continue;
+        }
+
+        variables++;
+        if (!nut_charts[index]->group || nut_charts[index]->group != group)
+            count++;
+        group = nut_charts[index]->group;
+    }
+
+    if (samples_per_tick > 1)
+        ups->samples = callocz(1, sizeof(struct ups_samples) + variables * sizeof(struct ups_aggregate));
+
+    count += __builtin_popcount(ups->derived);
+    slot = ups->slot = virtual_nodes ? 1 : chart_slots_reserve(count);
+    ups->slots = count;
+    ups_frame_init(&ups->frame, clean_ups_name, slot, variables, &srv->buffers_bytes);
+
+    if (virtual_nodes)
+        send_ups_host(srv, ups, ups_name);
+
+    send_ups_status_chart(srv->out, ups, "");
+    send_ups_labels(srv, ups, ups_name);
+    send_ups_status_dimensions(srv->out);
+    slot++;
+
+    group = NULL;
+    for (size_t index = NUT_VAR_CHARTS; index < NUT_VAR_MAX; index++) {
+        if (!nut_vars_bitmap_get(ups->charts, index))
+            continue;
+
+        const struct nd_chart *chart = nut_charts[index];
+        const struct nd_chart *def = nd_chart_of(chart);
+
+        netdata_log_info("Collecting UPS '%s' NUT variable: %s", ups_name, chart->nut_variable);
+
+        // The members of a template are the dimensions of the chart which the first one of
+        // them defines, so they are sent in one BEGIN/END block.
+        if (!chart->group || chart->group != group) {
+            send_ups_chart(srv->out, ups, def, slot, "");
+            send_ups_labels(srv, ups, ups_name);
+            ups_frame_add_begin(&ups->frame, &ups->frame.charts[rank].begin, slot++, clean_ups_name, def->chart_id);
+            dimension_slot = 1;
+        }
+        group = chart->group;
+
+        ups_frame_add_set(&ups->frame, &ups->frame.charts[rank].set, dimension_slot, chart->chart_dimension);
+        if (ups->samples && !def->is_static) {
+            struct ups_aggregate *agg = &ups->samples->charts[rank];
+            char dimension[BUFLEN];
+
+            snprintfz(dimension, sizeof(dimension), "%s_min", chart->chart_dimension);
+            ups_frame_add_set(&ups->frame, &agg->set_min, dimension_slot + 1, dimension);
+            snprintfz(dimension, sizeof(dimension), "%s_max", chart->chart_dimension);
+            ups_frame_add_set(&ups->frame, &agg->set_max, dimension_slot + 2, dimension);
+        }
+        send_ups_var_dimensions(srv->out, ups, chart, &dimension_slot);
+        rank++;
+    }
+
+    for (enum ups_derived derived = 0; derived < UPS_DERIVED_CHARTS; derived++) {
+        if (!(ups->derived & (1 << derived)))
+            continue;
+
+        send_ups_derived_chart(srv->out, ups, derived, slot, "");
+        send_ups_labels(srv, ups, ups_name);
+        send_ups_derived_dimensions(srv->out, ups, derived);
+
+        ups_frame_add_derived(&ups->frame, clean_ups_name, derived, slot++);
+    }
+
+    ups->energy.output_w = ups->energy.input_w = NAN;
+
+    srv->registration_last_ut = now_monotonic_usec() - started_ut;
+    if (srv->registration_last_ut > srv->registration_max_ut)
+        srv->registration_max_ut = srv->registration_last_ut;
+
+    ups->inventory.charge = ups->inventory.runtime = ups->inventory.load = NAN;
+
+    spinlock_lock(&srv->inventory_spinlock);
+    DOUBLE_LINKED_LIST_APPEND_ITEM_UNSAFE(srv->inventory, ups, prev, next);
+    spinlock_unlock(&srv->inventory_spinlock);
+
+    worker_is_busy(WORKER_UPSD_JOB_QUERY);
+    return ups;
+}
+
+// Defines the charts of a UPS again, in the order of their slots, e.g. to change their
+// update_every or to mark them obsolete. A CHART line starts the definition of its chart
+// over, so each one is followed by its labels and dimensions, as when the UPS was registered.
+// The static charts are only included on request.
+static void send_ups_charts(struct upsd_server *srv, const struct upsd_ups *ups, bool with_static, const char *options) {
+    BUFFER *wb = srv->out;
+    uint32_t slot = ups->slot, dimension_slot = 1;
+    size_t rank = 0;
+    bool defining = false;
+
+    send_ups_status_chart(wb, ups, options);
+    send_ups_labels(srv, ups, ups->name);
+    send_ups_status_dimensions(wb);
+    slot++;
+
+    // The members of a template are dimensions of the chart of the first one of them.
+    for (size_t word = 0; word < NUT_VARS_BITMAP_WORDS; word++) {
+        for (uint64_t charts = ups->charts[word]; charts; charts &= charts - 1) {
+            size_t index = word * 64 + __builtin_ctzll(charts);
+            const struct nd_chart *chart = nd_chart_of(nut_charts[index]);
+
+            if (ups->frame.charts[rank++].begin.length) {
+                defining = with_static || !chart->is_static;
+                if (defining) {
+                    send_ups_chart(wb, ups, chart, slot, options);
+                    send_ups_labels(srv, ups, ups->name);
+                }
+                dimension_slot = 1;
+                slot++;
+            }
+
+            if (defining)
+                send_ups_var_dimensions(wb, ups, nut_charts[index], &dimension_slot);
+        }
+    }
+
+    for (enum ups_derived derived = 0; derived < UPS_DERIVED_CHARTS; derived++) {
+        if (!(ups->derived & (1 << derived)))
+            continue;
+
+        send_ups_derived_chart(wb, ups, derived, slot++, options);
+        send_ups_labels(srv, ups, ups->name);
+        send_ups_derived_dimensions(wb, ups, derived);
+    }
+}
+
+// Switches a UPS between its steady and fast cadence. The agent learns of the update_every
+// of the charts of the UPS from their definitions, so the ones which change are defined
+// again, in the order of their slots.
+static void ups_set_fast(struct upsd_server *srv, struct upsd_ups *ups, bool fast) {
+    if (fast == ups->fast || steady_update_every == (time_t)netdata_update_every)
+        return;
+
+    if (fast && !fast_ups_acquire())
+        return;
+    if (!fast)
+        fast_ups_release();
+
+    ups->fast = fast;
+    netdata_log_info("UPS '%s' of upsd at %s:%d is now collected every %lu seconds",
+                     ups->name, srv->host, srv->port, ups_update_every(ups));
+
+    send_ups_charts(srv, ups, false, "");
+}
+
+// Takes a sample of a UPS: its status is parsed, and in the sub-second mode, the values of
+// its charts are added to the aggregates of the tick. The static charts are not aggregated,
+// since they are sent from the last sample.
+static void ups_sample(struct upsd_ups *ups, const struct nut_snapshot *snap) {
+    struct ups_samples *samples = ups->samples;
+    size_t rank = 0;
+
+    ups_status_update(ups, snap);
+
+    if (!samples)
+        return;
+
+    samples->count++;
+    for (size_t i = 0; i < LENGTHOF(ups_status_dimensions); i++)
+        samples->status[i] += (ups->status >> i) & 1;
+
+    for (size_t word = 0; word < NUT_VARS_BITMAP_WORDS; word++) {
+        for (uint64_t charts = ups->charts[word]; charts; charts &= charts - 1) {
+            size_t index = word * 64 + __builtin_ctzll(charts);
+            struct ups_aggregate *agg = &samples->charts[rank++];
+            NETDATA_DOUBLE value;
+
+            if (nd_chart_of(nut_charts[index])->is_static || !nut_snapshot_chart_value(snap, index, &value))
+                continue;
+
+            if (!agg->count || value < agg->min)
+                agg->min = value;
+            if (!agg->count || value > agg->max)
+                agg->max = value;
+            agg->sum += value;
+            agg->count++;
+        }
+    }
+}
+
+// Updates the state of the derived charts of a UPS from its collection at tick_ut, dt after
+// the previous one, and sends them. The energy is integrated with the trapezoidal rule, and
+// its running total is sent in mWh, which the chart shows in Wh. The time to empty is only
+// forecast while the battery discharges, once its charge has dropped.
+static void send_metrics_ups_derived(BUFFER *wb, const struct nut_snapshot *snap, struct upsd_ups *ups, usec_t tick_ut, usec_t dt) {
+    const struct ups_frame *frame = &ups->frame;
+    NETDATA_DOUBLE dt_s = (NETDATA_DOUBLE)dt / USEC_PER_SEC;
+    NETDATA_DOUBLE output_w = NAN;
+    NETDATA_DOUBLE input_w = nut_snapshot_get_double(snap, nut_chart_input_realpower);
+    NETDATA_DOUBLE charge = nut_snapshot_get_double(snap, nut_chart_charge);
+
+    nut_snapshot_chart_value(snap, nut_chart_realpower, &output_w);
+
+    if (dt && !isnan(output_w) && !isnan(ups->energy.output_w))
+        ups->energy.output_wh += (ups->energy.output_w + output_w) / 2 * dt_s / 3600;
+    if (dt && !isnan(input_w) && !isnan(ups->energy.input_w))
+        ups->energy.input_wh += (ups->energy.input_w + input_w) / 2 * dt_s / 3600;
+    ups->energy.output_w = output_w;
+    ups->energy.input_w = input_w;
+
+    if (!(ups->status & NUT_UPS_STATUS_DISCHRG)) {
+        freez(ups->energy.discharge);
+        ups->energy.discharge = NULL;
+    }
+    else if (!isnan(charge)) {
+        if (!ups->energy.discharge)
+            ups->energy.discharge = callocz(1, sizeof(*ups->energy.discharge));
+        ups_discharge_add(ups->energy.discharge, tick_ut, charge);
+    }
+
+    if (ups->derived & (1 << UPS_DERIVED_ENERGY)) {
+        send_BEGIN_span(wb, frame, &frame->derived_begin[UPS_DERIVED_ENERGY], dt);
+        send_SET(wb, frame, &frame->derived_set[UPS_DERIVED_ENERGY][0], (int64_t)llrint(ups->energy.output_wh * 1000));
+        if (ups_derived_dimensions(ups, UPS_DERIVED_ENERGY) > 1)
+            send_SET(wb, frame, &frame->derived_set[UPS_DERIVED_ENERGY][1], (int64_t)llrint(ups->energy.input_wh * 1000));
+        send_END(wb);
+    }
+
+    if ((ups->derived & (1 << UPS_DERIVED_EFFICIENCY)) && !isnan(output_w) && input_w > 0) {
+        send_BEGIN_span(wb, frame, &frame->derived_begin[UPS_DERIVED_EFFICIENCY], dt);
+        send_SET_value(wb, frame, &frame->derived_set[UPS_DERIVED_EFFICIENCY][0], output_w / input_w * 100);
+        send_END(wb);
+    }
+
+    NETDATA_DOUBLE time_to_empty;
+    if ((ups->derived & (1 << UPS_DERIVED_TIME_TO_EMPTY)) && ups->energy.discharge &&
+        ups_discharge_forecast(ups->energy.discharge, tick_ut, &time_to_empty)) {
+        send_BEGIN_span(wb, frame, &frame->derived_begin[UPS_DERIVED_TIME_TO_EMPTY], dt);
+        send_SET(wb, frame, &frame->derived_set[UPS_DERIVED_TIME_TO_EMPTY][0], (int64_t)llrint(time_to_empty));
+        send_END(wb);
+    }
+}
+
+// The static charts are only sent every static_update_every, from the variables of the
+// first collection of the UPS which is due. A UPS is collected on the ticks of its own
+// cadence, so that the time since its previous collection is given to the agent. In the
+// sub-second mode, this is called after the last sample of the tick, and the other charts
+// get the average, minimum and maximum of the samples.
+static void send_metrics_ups(struct upsd_server *srv, struct upsd_ups *ups, size_t tick, usec_t tick_ut) {
+    const struct nut_snapshot *snap = &srv->snapshot;
+    const struct ups_frame *frame = &ups->frame;
+    struct ups_samples *samples = ups->samples;
+    usec_t dt = ups->collected_ut ? tick_ut - ups->collected_ut : 0;
+    usec_t static_dt = ups->static_collected_ut ? tick_ut - ups->static_collected_ut : 0;
+    bool send_static = !ups->static_collected_ut ||
+        static_dt + netdata_update_every * USEC_PER_SEC / 2 >= static_update_every * USEC_PER_SEC;
+    size_t rank = 0;
+
+    ups->collected_ut = tick_ut;
+    if (send_static)
+        ups->static_collected_ut = tick_ut;
+
+    // All of the output of the UPS is in the scope of its virtual node, so the agent switches
+    // hosts once per UPS per tick.
+    if (virtual_nodes)
+        send_span(srv->out, frame, &frame->host);
+
+    // The 'ups.status' variable is a special case, because its chart has more
+    // than one dimension. So, we can't simply print one data point.
+    send_metric_ups_status(srv->out, ups, dt);
+
+    // A chart is begun by the first one of its variables which has a value, and it is ended
+    // by the next chart, since the members of a template follow one another.
+    const struct ups_frame_span *begin = NULL;
+    usec_t begin_dt = 0;
+    bool begun = false;
+
+    for (size_t word = 0; word < NUT_VARS_BITMAP_WORDS; word++) {
+        for (uint64_t charts = ups->charts[word]; charts; charts &= charts - 1) {
+            size_t index = word * 64 + __builtin_ctzll(charts);
+            const struct nd_chart *chart = nd_chart_of(nut_charts[index]);
+            struct ups_aggregate *agg = samples ? &samples->charts[rank] : NULL;
+            const struct ups_frame_chart *fc = &frame->charts[rank];
+            NETDATA_DOUBLE value;
+
+            rank++;
+
+            if (fc->begin.length) {
+                if (begun)
+                    send_END(srv->out);
+                begun = false;
+                begin = (!chart->is_static || send_static) ? &fc->begin : NULL;
+                begin_dt = chart->is_static ? static_dt : dt;
+            }
+
+            if (chart->is_static) {
+                if (!send_static || !nut_snapshot_chart_value(snap, index, &value))
+                    continue;
+            }
+            else if (agg) {
+                if (!agg->count)
+                    continue;
+            }
+            else if (!nut_snapshot_chart_value(snap, index, &value))
+                continue;
+
+            if (begin) {
+                send_BEGIN_span(srv->out, frame, begin, begin_dt);
+                begin = NULL;
+                begun = true;
+            }
+
+            if (agg && !chart->is_static) {
+                send_SET_value(srv->out, frame, &fc->set, agg->sum / agg->count);
+                send_SET_value(srv->out, frame, &agg->set_min, agg->min);
+                send_SET_value(srv->out, frame, &agg->set_max, agg->max);
+                agg->sum = 0;
+                agg->count = 0;
+            }
+            else
+                send_SET_value(srv->out, frame, &fc->set, value);
+        }
+    }
+
+    if (begun)
+        send_END(srv->out);
+
+    if (samples) {
+        samples->count = 0;
+        memset(samples->status, 0, sizeof(samples->status));
+    }
+
+    if (ups->derived)
+        send_metrics_ups_derived(srv->out, snap, ups, tick_ut, dt);
+
+    // A power event is collected every netdata_update_every, within the fast_ups_max budget.
+    ups_set_fast(srv, ups, ups->status & NUT_UPS_STATUS_FAST);
+    ups->next_tick = tick + ups_update_every(ups) / netdata_update_every;
+
+    NETDATA_DOUBLE charge = nut_snapshot_get_double(snap, nut_chart_charge);
+    NETDATA_DOUBLE runtime = nut_snapshot_get_double(snap, nut_chart_runtime);
+    NETDATA_DOUBLE load = nut_snapshot_get_double(snap, nut_chart_load);
+
+    spinlock_lock(&srv->inventory_spinlock);
+    ups->inventory.status = ups->status;
+    ups->inventory.charge = charge;
+    ups->inventory.runtime = runtime;
+    ups->inventory.load = load;
+    spinlock_unlock(&srv->inventory_spinlock);
+}
+
+
+// The charts about the plugin itself are per upsd server.
+static const char *upsd_server_id(const struct upsd_server *srv) {
+    return srv->name ? srv->name : "default";
+}
+
+// The charts about the plugin itself belong to the host of the agent, so they switch back
+// to it when the UPSes are virtual nodes.
+static inline void send_localhost(BUFFER *wb) {
+    if (virtual_nodes)
+        buffer_fast_strcat(wb, "HOST localhost\n", 15);
+}
+
+static void register_self(struct upsd_server *srv) {
+    send_localhost(srv->out);
+
+    // CHART type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_registration_time' '' 'UPS registration time' 'milliseconds' "
+           "'plugins' 'netdata.upsd_registration_time' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'last' '' 'absolute' 1 1000\n"
+           "DIMENSION 'max' '' 'absolute' 1 1000\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_REGISTRATION, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_reconnects' '' 'Reconnections to upsd' 'reconnects' "
+           "'plugins' 'netdata.upsd_reconnects' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'reconnects' '' 'absolute' 1 1\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_RECONNECTS, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_outage' '' 'upsd outage duration' 'seconds' "
+           "'plugins' 'netdata.upsd_outage' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'current' '' 'absolute' 1 1000000\n"
+           "DIMENSION 'last' '' 'absolute' 1 1000000\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_OUTAGE, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_memory' '' 'upsd collection memory' 'bytes' "
+           "'plugins' 'netdata.upsd_memory' 'stacked' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'ups' '' 'absolute' 1 1\n"
+           "DIMENSION 'ups_free' '' 'absolute' 1 1\n"
+           "DIMENSION 'buffers' '' 'absolute' 1 1\n"
+           "DIMENSION 'index' '' 'absolute' 1 1\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_MEMORY, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    if (!self_telemetry)
+        return;
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_requests' '' 'upsd queries' 'queries/s' "
+           "'plugins' 'netdata.upsd_requests' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'queries' '' 'incremental' 1 1\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_REQUESTS, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_response_time' '' 'upsd response time' 'milliseconds' "
+           "'plugins' 'netdata.upsd_response_time' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'p50' '' 'absolute' 1 1000\n"
+           "DIMENSION 'p90' '' 'absolute' 1 1000\n"
+           "DIMENSION 'p99' '' 'absolute' 1 1000\n"
+           "DIMENSION 'max' '' 'absolute' 1 1000\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_RTT, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_ups_collection_time' '' 'UPS collection time' 'milliseconds' "
+           "'plugins' 'netdata.upsd_ups_collection_time' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'average' '' 'absolute' 1 1000\n"
+           "DIMENSION 'max' '' 'absolute' 1 1000\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_COLLECTION, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_output' '' 'upsd plugin output' 'bytes/s' "
+           "'plugins' 'netdata.upsd_output' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'written' '' 'incremental' 1 1\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_OUTPUT, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+
+    buffer_sprintf(srv->out, "CHART 'netdata.upsd_%s_heartbeat_lateness' '' 'upsd collection lateness' 'milliseconds' "
+           "'plugins' 'netdata.upsd_heartbeat_lateness' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "CLABEL 'upsd_server' '%s:%d' %u\n"
+           "CLABEL_COMMIT\n"
+           "DIMENSION 'max' '' 'absolute' 1 1000\n",
+           upsd_server_id(srv), NETDATA_CHART_PRIO_UPSD_PLUGIN_LATENESS, netdata_update_every,
+           srv->host, srv->port, NETDATA_CLABEL_SOURCE_AUTO);
+}
+
+static void upsd_server_collection_add(struct upsd_server *srv, usec_t duration_ut) {
+    srv->collection_sum_ut += duration_ut;
+    if (duration_ut > srv->collection_max_ut)
+        srv->collection_max_ut = duration_ut;
+    srv->collections++;
+}
+
+static int usec_compare(const void *a, const void *b) {
+    usec_t x = *(const usec_t *)a, y = *(const usec_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sends the utilization of the worker of every upsd server thread, by its jobs. The caller
+// holds upsd_servers_mutex.
+static void upsd_worker_utilization_cb(
+    void *data, pid_t pid, const char *thread_tag, size_t max_job_id, size_t utilization_usec,
+    size_t duration_usec, size_t jobs_started, size_t is_running, STRING **job_types_names,
+    STRING **job_types_units, WORKER_METRIC_TYPE *job_metric_types, size_t *job_types_jobs_started,
+    usec_t *job_types_busy_time, NETDATA_DOUBLE *job_custom_values, const char *spinlock_functions[],
+    size_t *spinlock_locks, size_t *spinlock_spins, uint64_t *memory_calls) {
+    BUFFER *wb = data;
+    const struct upsd_server *s;
+
+    for (s = upsd_servers; s && s->tid != pid; s = s->next)
+        ;
+    if (!s || !duration_usec)
+        return;
+
+    buffer_sprintf(wb, "BEGIN 'netdata.upsd_%s_worker'\n", upsd_server_id(s));
+    for (size_t job = 0; job < WORKER_UPSD_JOBS && job <= max_job_id; job++)
+        buffer_sprintf(wb, "SET '%s' = %" PRIu64 "\n", worker_upsd_job_names[job],
+                       (uint64_t)job_types_busy_time[job] * 100 * 1000 / duration_usec);
+    buffer_strcat(wb, "END\n");
+}
+
+// Sends the self telemetry of the tick, and starts over the per tick values.
+static void send_metrics_telemetry(struct upsd_server *srv, usec_t dt) {
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_requests' %" PRIu64 "\n"
+           "SET 'queries' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt, srv->requests);
+
+    usec_t *rtt = srv->nut.rtt;
+    size_t rtt_used = srv->nut.rtt_used;
+
+    if (rtt_used) {
+        qsort(rtt, rtt_used, sizeof(*rtt), usec_compare);
+        buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_response_time' %" PRIu64 "\n"
+               "SET 'p50' = %" PRIu64 "\n"
+               "SET 'p90' = %" PRIu64 "\n"
+               "SET 'p99' = %" PRIu64 "\n"
+               "SET 'max' = %" PRIu64 "\n"
+               "END\n",
+               upsd_server_id(srv), dt,
+               rtt[(rtt_used - 1) * 50 / 100],
+               rtt[(rtt_used - 1) * 90 / 100],
+               rtt[(rtt_used - 1) * 99 / 100],
+               rtt[rtt_used - 1]);
+    }
+
+    if (srv->collections)
+        buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_ups_collection_time' %" PRIu64 "\n"
+               "SET 'average' = %" PRIu64 "\n"
+               "SET 'max' = %" PRIu64 "\n"
+               "END\n",
+               upsd_server_id(srv), dt, srv->collection_sum_ut / srv->collections, srv->collection_max_ut);
+
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_output' %" PRIu64 "\n"
+           "SET 'written' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt, srv->output_bytes);
+
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_heartbeat_lateness' %" PRIu64 "\n"
+           "SET 'max' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt, srv->lateness_max_ut);
+
+    srv->nut.rtt_used = 0;
+    srv->collection_sum_ut = srv->collection_max_ut = 0;
+    srv->collections = 0;
+    srv->lateness_max_ut = 0;
+}
+
+static void send_metrics_self(struct upsd_server *srv, usec_t dt) {
+    send_localhost(srv->out);
+
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_registration_time' %" PRIu64 "\n"
+           "SET 'last' = %" PRIu64 "\n"
+           "SET 'max' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt, srv->registration_last_ut, srv->registration_max_ut);
+
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_reconnects' %" PRIu64 "\n"
+           "SET 'reconnects' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt, srv->reconnects);
+
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_outage' %" PRIu64 "\n"
+           "SET 'current' = %" PRIu64 "\n"
+           "SET 'last' = %" PRIu64 "\n"
+           "END\n",
+           upsd_server_id(srv), dt,
+           srv->outage_started_ut ? now_monotonic_usec() - srv->outage_started_ut : 0,
+           srv->outage_last_ut);
+
+    // The memory of the collection must stay flat while UPSes come and go, since the
+    // plugin is no longer restarted periodically.
+    buffer_sprintf(srv->out, "BEGIN 'netdata.upsd_%s_memory' %" PRIu64 "\n"
+           "SET 'ups' = %zu\n"
+           "SET 'ups_free' = %zu\n"
+           "SET 'buffers' = %zu\n"
+           "SET 'index' = %zd\n"
+           "END\n",
+           upsd_server_id(srv), dt,
+           aral_used_bytes(srv->ups_aral),
+           aral_free_bytes(srv->ups_aral),
+           __atomic_load_n(&srv->buffers_bytes, __ATOMIC_RELAXED),
+           srv->ups_stats.memory.index + srv->ups_stats.memory.values + srv->ups_stats.memory.dict);
+}
+
+// Writes a buffer of output to stdout, and empties it. Returns false if netdata has gone
+// away.
+static bool plugin_flush(BUFFER *wb) {
+    bool ok = true;
+
+    netdata_mutex_lock(&stdout_mutex);
+
+    fwrite(buffer_tostring(wb), 1, buffer_strlen(wb), stdout);
+
+    // stdout, stderr are connected to pipes.
+    // So, if they are closed then netdata must have exited.
+    // Flush the data out of the stream buffer to ensure netdata gets it immediately.
+    fflush(stdout);
+    if (unlikely(ferror(stdout) && errno == EPIPE)) {
+        netdata_log_error("failed to fflush(3) upsd data: %s", strerror(errno));
+        plugin_should_exit = true;
+        ok = false;
+    }
+
+    netdata_mutex_unlock(&stdout_mutex);
+
+    buffer_flush(wb);
+    return ok;
+}
+
+// Writes the output of the current tick to stdout. Returns false if netdata has gone away.
+static bool upsd_server_flush(struct upsd_server *srv) {
+    worker_is_busy(WORKER_UPSD_JOB_FLUSH);
+    srv->output_bytes += buffer_strlen(srv->out);
+
+    return plugin_flush(srv->out);
+}
+
+// Waits for the next sample, and returns the time since the previous tick on the first
+// sample of a tick, or 0. The heartbeat beats every tick, since it wakes up a little after
+// the step, which would delay short steps by whole steps; the other samples of a tick are
+// spread evenly after it. A replay at full speed does not wait for the samples, as if each
+// one took exactly its time.
+static usec_t upsd_server_heartbeat(struct upsd_server *srv) {
+    usec_t dt = 0, late_ut = 0;
+
+    if (unlikely(nut_capture_replaying(&srv->nut.capture) && !nut_capture_realtime))
+        return sample_every_ut;
+
+    if (!srv->sample) {
+        dt = heartbeat_next(&srv->hb);
+        srv->tick_started_ut = now_monotonic_usec();
+        if (dt > netdata_update_every * USEC_PER_SEC)
+            late_ut = dt - netdata_update_every * USEC_PER_SEC;
+    }
+    else {
+        usec_t due_ut = srv->tick_started_ut + srv->sample * sample_every_ut;
+        usec_t now_ut = now_monotonic_usec();
+        if (now_ut < due_ut)
+            sleep_usec(due_ut - now_ut);
+        else
+            late_ut = now_ut - due_ut;
+    }
+
+    if (unlikely(self_telemetry) && late_ut > srv->lateness_max_ut)
+        srv->lateness_max_ut = late_ut;
+
+    return dt;
+}
+
+// Queues a 'LIST VAR' query for a UPS which upsd knows of, but we do not yet; its response
+// registers the UPS without blocking the collection of the others. A name which upsd lists
+// twice is probed once, and one which does not fit in the probes is not probed at all, since
+// its response would register the UPS under another name.
+static void upsd_server_probe(struct upsd_server *srv, const char *ups_name) {
+    if (unlikely(strlen(ups_name) >= BUFLEN)) {
+        // upsd lists it on every tick
+        nd_log_limit_static_thread_var(erl, 3600, 0);
+        nd_log_limit(&erl, NDLS_COLLECTORS, NDLP_ERR, "UPS name of upsd at %s:%d is too long to collect: %s",
+                     srv->host, srv->port, ups_name);
+        return;
+    }
+
+    for (size_t i = 0; i < srv->probes_used; i++)
+        if (unlikely(streq(srv->probes[i], ups_name)))
+            return;
+
+    if (srv->probes_used == srv->probes_size) {
+        srv->probes_size = srv->probes_size ? srv->probes_size * 2 : 4;
+        srv->probes = reallocz(srv->probes, srv->probes_size * sizeof(*srv->probes));
+    }
+
+    strncpyz(srv->probes[srv->probes_used++], ups_name, BUFLEN - 1);
+    nut_client_request_list(&srv->nut, "VAR", ups_name);
+    srv->requests++;
+}
+
+// Removes the UPSes which the 'LIST UPS' query of the tick did not list, once their charts
+// are marked obsolete, so that the agent frees them too. Since every tick counts the UPSes
+// which are listed, this scan only runs when some of them are gone.
+static void upsd_server_sweep(struct upsd_server *srv, size_t tick) {
+    struct upsd_ups *ups;
+
+    dfe_start_read(srv->ups, ups) {
+        if (ups->seen_tick == tick)
+            continue;
+
+        netdata_log_info("UPS '%s' of upsd at %s:%d is gone, so its charts are obsolete", ups->name, srv->host, srv->port);
+
+        if (virtual_nodes)
+            send_span(srv->out, &ups->frame, &ups->frame.host);
+        send_ups_charts(srv, ups, true, "obsolete");
+
+        dictionary_del(srv->ups, ups_dfe.name);
+        upsd_ups_free(srv, ups);
+    }
+    dfe_done(ups);
+
+    send_localhost(srv->out);
+}
+
+// Collects a connected upsd server until either the connection fails, in which case it
+// returns true so that the server is reconnected, or the plugin should exit. The UPSes which
+// were registered before a reconnection are kept, along with their charts, and the ones
+// which are gone are removed after the first tick.
+static bool upsd_server_collect(struct upsd_server *srv) {
+    int rc;
+    struct upsd_ups *ups;
+
+    // A tick starts over after a reconnection.
+    srv->sample = 0;
+    srv->tick_dt = 0;
+    srv->probes_used = 0;
+
+    for (;;) {
+        worker_is_idle();
+        srv->tick_dt += upsd_server_heartbeat(srv);
+
+        // In the sub-second mode, a tick takes samples_per_tick samples, and only the last
+        // one sends the metrics.
+        bool first_sample = srv->sample == 0;
+        bool last_sample = ++srv->sample == samples_per_tick;
+        size_t tick = first_sample ? ++srv->tick : srv->tick;
+        usec_t tick_ut = now_monotonic_usec();
+        usec_t deadline_ut = tick_ut + NUT_CLIENT_TIMEOUT_SEC * USEC_PER_SEC;
+
+        if (unlikely(plugin_should_exit || exit_initiated_get()))
+            break;
+
+        // Pipeline all of the queries of this sample: the UPSes which upsd knows of, on the
+        // first sample of the tick, and the variables of every UPS which we know of and which
+        // is due. The UPSes which are new to us are probed within the same round trip, and
+        // are collected from the next tick onwards.
+        size_t requested = 0;
+        worker_is_busy(WORKER_UPSD_JOB_QUERY);
+        if (first_sample)
+            nut_client_request_list(&srv->nut, "UPS", NULL);
+        dfe_start_read(srv->ups, ups) {
+            if (ups->next_tick > tick)
+                continue;
+            nut_client_request_list(&srv->nut, "VAR", ups_dfe.name);
+            requested++;
+        }
+        dfe_done(ups);
+        srv->requests += requested + first_sample;
+
+        if (first_sample) {
+            if (unlikely(1 != nut_client_list_begin(&srv->nut, deadline_ut))) {
+                netdata_log_error("failed to list UPSes from upsd at %s:%d: %s", srv->host, srv->port, strerror(errno));
+                return true;
+            }
+
+            // The response to 'LIST UPS' is a sequence of lines like so:
+            //   UPS <UPS name> "<UPS description>"
+            srv->listed = 0;
+            while (1 == (rc = nut_client_list_next(&srv->nut, deadline_ut))) {
+                if (unlikely(srv->nut.num_words < 2 || !streq(srv->nut.words[0], "UPS")))
+                    continue;
+
+                char *name = srv->nut.words[1];
+                ups = dictionary_get(srv->ups, name);
+                if (likely(ups)) {
+                    ups->seen_tick = tick;
+                    srv->listed++;
+                }
+                else
+                    upsd_server_probe(srv, name);
+            }
+
+            if (unlikely(-1 == rc)) {
+                netdata_log_error("failed to list UPSes from upsd at %s:%d: %s", srv->host, srv->port, strerror(errno));
+                return true;
+            }
+        }
+
+        // The responses to 'LIST VAR' arrive in the order of the queries. Each one names
+        // its UPS on its first line, unless it is an error (e.g. the UPS was removed).
+        for (size_t i = 0; i < requested; i++) {
+            rc = nut_client_list_begin(&srv->nut, deadline_ut);
+            if (rc == 0)
+                continue;
+
+            // BEGIN LIST VAR <UPS name>
+            ups = (rc == 1 && srv->nut.num_words >= 4) ? dictionary_get(srv->ups, srv->nut.words[3]) : NULL;
+
+            if (unlikely(rc == -1 || !nut_client_read_vars(&srv->nut, &srv->snapshot, deadline_ut))) {
+                netdata_log_error("failed to list UPS variables from upsd at %s:%d: %s", srv->host, srv->port, strerror(errno));
+                return true;
+            }
+
+            if (likely(ups)) {
+                usec_t started_ut = self_telemetry ? now_monotonic_usec() : 0;
+
+                worker_is_busy(WORKER_UPSD_JOB_COLLECT);
+                ups_sample(ups, &srv->snapshot);
+                if (last_sample)
+                    send_metrics_ups(srv, ups, tick, tick_ut);
+                worker_is_busy(WORKER_UPSD_JOB_QUERY);
+
+                if (unlikely(self_telemetry))
+                    upsd_server_collection_add(srv, now_monotonic_usec() - started_ut);
+            }
+        }
+
+        // The responses to the probes follow those of the UPSes which we already know of.
+        for (size_t i = 0; i < srv->probes_used; i++) {
+            rc = nut_client_list_begin(&srv->nut, deadline_ut);
+            if (rc == 0)
+                continue;
+
+            if (unlikely(rc == -1 || !(ups = register_ups(srv, srv->probes[i], deadline_ut)))) {
+                netdata_log_error("failed to list UPS variables from upsd at %s:%d: %s", srv->host, srv->port, strerror(errno));
+                return true;
+            }
+
+            ups->seen_tick = tick;
+            ups->next_tick = tick + 1;
+            srv->listed++;
+        }
+        srv->probes_used = 0;
+
+        if (!last_sample)
+            continue;
+
+        if (unlikely(srv->listed != dictionary_entries(srv->ups)))
+            upsd_server_sweep(srv, tick);
+
+        send_metrics_self(srv, srv->tick_dt);
+        if (unlikely(self_telemetry))
+            send_metrics_telemetry(srv, srv->tick_dt);
+        srv->sample = 0;
+        srv->tick_dt = 0;
+
+        if (unlikely(!upsd_server_flush(srv)))
+            return false;
+
+        // upsd is healthy again, so the next outage starts over with the shortest delay.
+        srv->backoff_ut = 0;
+
+        if (unlikely(plugin_should_exit || exit_initiated_get()))
+            break;
+
+        // Exit, for netdata to restart the plugin, only if upsd.conf asks for it.
+        if (unlikely(restart_every && now_monotonic_sec() - plugin_started_s >= restart_every))
+            break;
+    }
+
+    srv->exit_code = NETDATA_PLUGIN_EXIT_AND_RESTART;
+    return false;
+}
+
+static bool upsd_server_connect(struct upsd_server *srv) {
+    return nut_client_connect(&srv->nut, srv->host, srv->port, &srv->buffers_bytes);
+}
+
+static void upsd_server_disconnect(struct upsd_server *srv) {
+    nut_client_disconnect(&srv->nut);
+}
+
+// Waits before reconnecting to upsd. The delay grows exponentially, and it is randomized
+// by up to half of it, so that the collectors of a upsd server which has just restarted do
+// not all reconnect at once. The charts about the plugin itself are still sent meanwhile,
+// so that the outage shows; the charts of the UPSes get gaps. Returns false if the plugin
+// should exit.
+static bool upsd_server_backoff(struct upsd_server *srv) {
+    usec_t now_ut = now_monotonic_usec();
+
+    if (!srv->outage_started_ut) {
+        srv->outage_started_ut = now_ut;
+        netdata_log_info("lost connection to upsd at %s:%d, reconnecting", srv->host, srv->port);
+    }
+
+    srv->backoff_ut = srv->backoff_ut ? MIN(srv->backoff_ut * 2, UPSD_RECONNECT_MAX_SEC * USEC_PER_SEC) : UPSD_RECONNECT_MIN_SEC * USEC_PER_SEC;
+    usec_t until_ut = now_ut + srv->backoff_ut / 2 + os_random32() % (srv->backoff_ut / 2 + 1);
+
+    while (now_monotonic_usec() < until_ut) {
+        usec_t dt = heartbeat_next(&srv->hb);
+
+        if (unlikely(plugin_should_exit || exit_initiated_get()))
+            return false;
+
+        send_metrics_self(srv, dt);
+        if (unlikely(!upsd_server_flush(srv)))
+            return false;
+    }
+
+    return true;
+}
+
+static void *upsd_server_thread(void *arg) {
+    struct upsd_ups *ups;
+    struct upsd_server *srv = arg;
+
+    srv->ups = dictionary_create_advanced(DICT_OPTION_SINGLE_THREADED|DICT_OPTION_FIXED_SIZE|DICT_OPTION_VALUE_LINK_DONT_CLONE, &srv->ups_stats, 0);
+    srv->ups_aral = aral_create("upsd_ups", sizeof(struct upsd_ups), 0, 0, NULL, NULL, NULL, false, true, false);
+    srv->out = buffer_create(4096, &srv->buffers_bytes);
+    srv->exit_code = NETDATA_PLUGIN_EXIT_AND_DISABLE;
+
+    // The worker is only registered when self_telemetry enabled the workers.
+    srv->tid = gettid_cached();
+    worker_register("UPSD");
+    for (size_t job = 0; job < WORKER_UPSD_JOBS; job++)
+        worker_register_job_name(job, worker_upsd_job_names[job]);
+
+    heartbeat_init(&srv->hb, netdata_update_every * USEC_PER_SEC);
+    register_self(srv);
+
+    // Without its capture, a replay has nothing to collect.
+    bool run = nut_capture_open(&srv->nut.capture, upsd_server_id(srv)) || !nut_capture_replaying(&srv->nut.capture);
+
+    // Whatever goes wrong with upsd, the thread keeps reconnecting to it until the plugin
+    // exits, so that neither the UPSes nor their charts have to be registered again. A
+    // replay ends with its capture.
+    while (run && !plugin_should_exit && !exit_initiated_get()) {
+        if (upsd_server_connect(srv)) {
+            if (srv->outage_started_ut) {
+                srv->outage_last_ut = now_monotonic_usec() - srv->outage_started_ut;
+                srv->outage_started_ut = 0;
+                srv->reconnects++;
+                netdata_log_info("reconnected to upsd at %s:%d after %" PRIu64 " seconds",
+                                 srv->host, srv->port, (uint64_t)(srv->outage_last_ut / USEC_PER_SEC));
+            }
+
+            bool reconnect = upsd_server_collect(srv);
+            upsd_server_disconnect(srv);
+            if (!reconnect || nut_capture_replaying(&srv->nut.capture))
+                break;
+        }
+
+        if (!upsd_server_backoff(srv))
+            break;
+    }
+
+    dfe_start_read(srv->ups, ups) {
+        dictionary_del(srv->ups, ups_dfe.name);
+        upsd_ups_free(srv, ups);
+    }
+    dfe_done(ups);
+
+    dictionary_destroy(srv->ups);
+    aral_destroy(srv->ups_aral);
+    buffer_free(srv->out);
+    freez(srv->nut.rtt);
+    freez(srv->nut.queries);
+    freez(srv->probes);
+    nut_capture_close(&srv->nut.capture);
+    if (srv->nut.tls_session)
+        SSL_SESSION_free(srv->nut.tls_session);
+
+    worker_unregister();
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// The self telemetry of the whole plugin
+//
+// The charts about the whole plugin, rather than about one upsd server, are sent by a
+// thread of their own, which outlives the collector threads of the upsd servers, so that
+// they do not stop with any one of them.
+
+static void register_self_plugin(BUFFER *wb) {
+    send_localhost(wb);
+
+    netdata_mutex_lock(&upsd_servers_mutex);
+    for (const struct upsd_server *s = upsd_servers; s; s = s->next) {
+        // CHART type.id name title units [family [context [charttype [priority [update_every [options [plugin [module]]]]]]]]
+        buffer_sprintf(wb, "CHART 'netdata.upsd_%s_worker' '' 'upsd collector thread utilization' 'percentage' "
+               "'plugins' 'netdata.upsd_worker' 'stacked' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+               "CLABEL 'upsd_server' '%s:%d' %u\n"
+               "CLABEL_COMMIT\n",
+               upsd_server_id(s), NETDATA_CHART_PRIO_UPSD_PLUGIN_WORKER, netdata_update_every,
+               s->host, s->port, NETDATA_CLABEL_SOURCE_AUTO);
+        for (size_t job = 0; job < WORKER_UPSD_JOBS; job++)
+            buffer_sprintf(wb, "DIMENSION '%s' '' 'absolute' 1 1000\n", worker_upsd_job_names[job]);
+    }
+    netdata_mutex_unlock(&upsd_servers_mutex);
+
+    buffer_sprintf(wb, "CHART 'netdata.upsd_rss' '' 'upsd plugin resident memory' 'bytes' "
+           "'plugins' 'netdata.upsd_rss' 'line' %u %lu '' '" PLUGIN_UPSD_NAME "'\n"
+           "DIMENSION 'rss' '' 'absolute' 1 1\n",
+           NETDATA_CHART_PRIO_UPSD_PLUGIN_RSS, netdata_update_every);
+}
+
+static void send_metrics_self_plugin(BUFFER *wb, usec_t dt) {
+    send_localhost(wb);
+
+    netdata_mutex_lock(&upsd_servers_mutex);
+    workers_foreach("UPSD", upsd_worker_utilization_cb, wb);
+    netdata_mutex_unlock(&upsd_servers_mutex);
+
+    OS_PROCESS_MEMORY mem = os_process_memory(0);
+    if (OS_PROCESS_MEMORY_OK(mem))
+        buffer_sprintf(wb, "BEGIN 'netdata.upsd_rss' %" PRIu64 "\n"
+               "SET 'rss' = %" PRIu64 "\n"
+               "END\n",
+               dt, mem.rss);
+}
+
+// It runs until main() cancels it, once the collector threads of all upsd servers ended.
+static void *upsd_telemetry_thread(void *arg __maybe_unused) {
+    BUFFER *wb = buffer_create(4096, NULL);
+    heartbeat_t hb;
+
+    heartbeat_init(&hb, netdata_update_every * USEC_PER_SEC);
+    register_self_plugin(wb);
+
+    while (!nd_thread_signaled_to_cancel() && !plugin_should_exit && !exit_initiated_get()) {
+        usec_t dt = heartbeat_next(&hb);
+
+        if (unlikely(nd_thread_signaled_to_cancel() || plugin_should_exit || exit_initiated_get()))
+            break;
+
+        send_metrics_self_plugin(wb, dt);
+        if (unlikely(!plugin_flush(wb)))
+            break;
+    }
+
+    buffer_free(wb);
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// The ups-inventory function
+//
+// It is served by the functions worker thread, from the state of the UPSes as of their most
+// recent tick, so that it causes no queries to upsd and never delays the collection.
+
+#define UPSD_FUNCTION_INVENTORY      "ups-inventory"
+#define UPSD_FUNCTION_INVENTORY_HELP "Shows the UPSes of all upsd servers, with their status, battery, load and device information."
+
+static const char *upsd_function_inventory_severity(uint32_t status) {
+    if (status & (NUT_UPS_STATUS_LB | NUT_UPS_STATUS_FSD | NUT_UPS_STATUS_OVER | NUT_UPS_STATUS_OFF | NUT_UPS_STATUS_NOCOMM))
+        return "critical";
+    if (status & (NUT_UPS_STATUS_OB | NUT_UPS_STATUS_RB | NUT_UPS_STATUS_BYPASS | NUT_UPS_STATUS_ALARM))
+        return "warning";
+    return "normal";
+}
+
+static void upsd_function_inventory_add_row(BUFFER *wb, const struct upsd_server *srv, const struct upsd_ups *ups) {
+    char address[BUFLEN];
+    char status[512] = "";
+    size_t len = 0;
+
+    snprintfz(address, sizeof(address), "%s:%d", srv->host, srv->port);
+
+    for (size_t i = 0; i < LENGTHOF(ups_status_dimensions); i++)
+        if (ups->inventory.status & (1U << i))
+            len += snprintfz(&status[len], sizeof(status) - len, "%s%s", len ? " " : "", ups_status_dimensions[i]);
+
+    buffer_json_add_array_item_array(wb);
+
+    buffer_json_add_array_item_string(wb, ups->clean_name);
+    buffer_json_add_array_item_string(wb, ups->name);
+    buffer_json_add_array_item_string(wb, address);
+    buffer_json_add_array_item_string(wb, status);
+    buffer_json_add_array_item_double(wb, ups->inventory.charge);
+    buffer_json_add_array_item_double(wb, ups->inventory.runtime);
+    buffer_json_add_array_item_double(wb, ups->inventory.load);
+    for (size_t i = 0; i < LENGTHOF(ups_labels); i++)
+        buffer_json_add_array_item_string(wb, ups->labels[i]);
+
+    buffer_json_add_array_item_object(wb);
+    buffer_json_member_add_string(wb, "severity", upsd_function_inventory_severity(ups->inventory.status));
+    buffer_json_object_close(wb);
+
+    buffer_json_array_close(wb);
+}
+
+static void upsd_function_inventory_add_string_field(BUFFER *wb, size_t field_id, const char *key, const char *name, RRDF_FIELD_OPTIONS options) {
+    buffer_rrdf_table_add_field(wb, field_id, key, name,
+            RRDF_FIELD_TYPE_STRING, RRDF_FIELD_VISUAL_VALUE, RRDF_FIELD_TRANSFORM_NONE,
+            0, NULL, NAN, RRDF_FIELD_SORT_ASCENDING, NULL,
+            RRDF_FIELD_SUMMARY_COUNT, RRDF_FIELD_FILTER_MULTISELECT,
+            options, NULL);
+}
+
+static void upsd_function_inventory_add_number_field(BUFFER *wb, size_t field_id, const char *key, const char *name, const char *units, NETDATA_DOUBLE max) {
+    buffer_rrdf_table_add_field(wb, field_id, key, name,
+            RRDF_FIELD_TYPE_BAR_WITH_INTEGER, RRDF_FIELD_VISUAL_BAR, RRDF_FIELD_TRANSFORM_NUMBER,
+            0, units, max, RRDF_FIELD_SORT_DESCENDING, NULL,
+            RRDF_FIELD_SUMMARY_MEAN, RRDF_FIELD_FILTER_RANGE,
+            RRDF_FIELD_OPTS_VISIBLE, NULL);
+}
+
+static void upsd_function_inventory(const char *transaction, char *function,
+                                    usec_t *stop_monotonic_ut __maybe_unused, bool *cancelled __maybe_unused,
+                                    BUFFER *payload __maybe_unused, HTTP_ACCESS access __maybe_unused,
+                                    const char *source __maybe_unused, void *data __maybe_unused) {
+    time_t now_s = now_realtime_sec();
+
+    BUFFER *wb = buffer_create(4096, NULL);
+    buffer_json_initialize(wb, "\"", "\"", 0, true, BUFFER_JSON_OPTIONS_NEWLINE_ON_ARRAY_ITEMS);
+    buffer_json_member_add_uint64(wb, "status", HTTP_RESP_OK);
+    buffer_json_member_add_string(wb, "type", "table");
+    buffer_json_member_add_time_t(wb, "update_every", netdata_update_every);
+    buffer_json_member_add_boolean(wb, "has_history", false);
+    buffer_json_member_add_string(wb, "help", UPSD_FUNCTION_INVENTORY_HELP);
+
+    char function_copy[strlen(function) + 1];
+    memcpy(function_copy, function, sizeof(function_copy));
+    char *words[1024];
+    size_t num_words = quoted_strings_splitter_whitespace(function_copy, words, 1024);
+    for (size_t i = 1; i < num_words; i++) {
+        if (streq(get_word(words, num_words, i), "info")) {
+            buffer_json_member_add_array(wb, "accepted_params");
+            buffer_json_array_close(wb); // accepted_params
+            buffer_json_member_add_array(wb, "required_params");
+            buffer_json_array_close(wb); // required_params
+            goto close_and_send;
+        }
+    }
+
+    buffer_json_member_add_array(wb, "data");
+    netdata_mutex_lock(&upsd_servers_mutex);
+    for (struct upsd_server *srv = upsd_servers; srv; srv = srv->next) {
+        spinlock_lock(&srv->inventory_spinlock);
+        for (struct upsd_ups *ups = srv->inventory; ups; ups = ups->next)
+            upsd_function_inventory_add_row(wb, srv, ups);
+        spinlock_unlock(&srv->inventory_spinlock);
+    }
+    netdata_mutex_unlock(&upsd_servers_mutex);
+    buffer_json_array_close(wb); // data
+
+    buffer_json_member_add_object(wb, "columns");
+    {
+        size_t field_id = 0;
+
+        upsd_function_inventory_add_string_field(wb, field_id++, "ID", "Chart Prefix",
+                RRDF_FIELD_OPTS_UNIQUE_KEY);
+        upsd_function_inventory_add_string_field(wb, field_id++, "UPS", "UPS Name",
+                RRDF_FIELD_OPTS_VISIBLE | RRDF_FIELD_OPTS_STICKY | RRDF_FIELD_OPTS_FULL_WIDTH);
+        upsd_function_inventory_add_string_field(wb, field_id++, "Server", "upsd Server",
+                RRDF_FIELD_OPTS_VISIBLE);
+        upsd_function_inventory_add_string_field(wb, field_id++, "Status", "UPS Status",
+                RRDF_FIELD_OPTS_VISIBLE | RRDF_FIELD_OPTS_FULL_WIDTH);
+        upsd_function_inventory_add_number_field(wb, field_id++, "Charge", "Battery Charge", "%", 100);
+        upsd_function_inventory_add_number_field(wb, field_id++, "Runtime", "Battery Runtime", "seconds", NAN);
+        upsd_function_inventory_add_number_field(wb, field_id++, "Load", "UPS Load", "%", 100);
+
+        for (size_t i = 0; i < LENGTHOF(ups_labels); i++)
+            upsd_function_inventory_add_string_field(wb, field_id++, ups_labels[i].title, ups_labels[i].title,
+                    RRDF_FIELD_OPTS_VISIBLE);
+
+        buffer_rrdf_table_add_field(
+                wb, field_id++,
+                "rowOptions", "rowOptions",
+                RRDF_FIELD_TYPE_NONE,
+                RRDR_FIELD_VISUAL_ROW_OPTIONS,
+                RRDF_FIELD_TRANSFORM_NONE, 0, NULL, NAN,
+                RRDF_FIELD_SORT_FIXED,
+                NULL,
+                RRDF_FIELD_SUMMARY_COUNT,
+                RRDF_FIELD_FILTER_NONE,
+                RRDF_FIELD_OPTS_DUMMY,
+                NULL);
+    }
+    buffer_json_object_close(wb); // columns
+    buffer_json_member_add_string(wb, "default_sort_column", "UPS");
+
+close_and_send:
+    buffer_json_member_add_time_t(wb, "expires", now_s + netdata_update_every);
+    buffer_json_finalize(wb);
+
+    wb->response_code = HTTP_RESP_OK;
+    wb->content_type = CT_APPLICATION_JSON;
+    wb->expires = now_s + netdata_update_every;
+
+    netdata_mutex_lock(&stdout_mutex);
+    pluginsd_function_result_to_stdout(transaction, wb);
+    netdata_mutex_unlock(&stdout_mutex);
+
+    buffer_free(wb);
+}
+
+static struct functions_evloop_globals *upsd_functions_init(void) {
+    struct functions_evloop_globals *wg = functions_evloop_init(1, "UPSD", &stdout_mutex, &plugin_should_exit);
+    functions_evloop_add_function(wg, UPSD_FUNCTION_INVENTORY, upsd_function_inventory, PLUGINS_FUNCTIONS_TIMEOUT_DEFAULT, NULL);
+
+    netdata_mutex_lock(&stdout_mutex);
+    fprintf(stdout, PLUGINSD_KEYWORD_FUNCTION " GLOBAL \"" UPSD_FUNCTION_INVENTORY "\" %d \"%s\" \"top\" " HTTP_ACCESS_FORMAT " %d\n",
+            PLUGINS_FUNCTIONS_TIMEOUT_DEFAULT, UPSD_FUNCTION_INVENTORY_HELP,
+            (HTTP_ACCESS_FORMAT_CAST)(HTTP_ACCESS_NONE), 100);
+    fflush(stdout);
+    netdata_mutex_unlock(&stdout_mutex);
+
+    return wg;
+}
+
+// Adds the upsd server at 'address', which is either 'host', 'host:port' or '[host]:port'.
+static void upsd_server_add(const char *name, const char *address) {
+    struct upsd_server *srv = callocz(1, sizeof(*srv));
+    const char *port = NULL;
+
+    if (*address == '[' && strchr(address, ']')) {
+        const char *end = strchr(address, ']');
+        srv->host = strndupz(address + 1, end - address - 1);
+        if (end[1] == ':')
+            port = &end[2];
+    } else if (strchr(address, ':') && strchr(address, ':') == strrchr(address, ':')) {
+        const char *colon = strchr(address, ':');
+        srv->host = strndupz(address, colon - address);
+        port = colon + 1;
+    } else
+        srv->host = strdupz(address);
+
+    spinlock_init(&srv->inventory_spinlock);
+    srv->name = name ? strdupz(name) : NULL;
+    srv->port = port ? str2i(port) : UPSD_DEFAULT_PORT;
+    if (srv->port <= 0 || srv->port > 65535) {
+        netdata_log_error("invalid port of upsd server '%s' (%s), using %d", name, address, UPSD_DEFAULT_PORT);
+        srv->port = UPSD_DEFAULT_PORT;
+    }
+
+    DOUBLE_LINKED_LIST_APPEND_ITEM_UNSAFE(upsd_servers, srv, prev, next);
+}
+
+static void upsd_server_free(struct upsd_server *srv) {
+    freez(srv->name);
+    freez(srv->host);
+    freez(srv);
+}
+
+static bool upsd_servers_add_cb(void *data __maybe_unused, const char *name, const char *value) {
+    upsd_server_add(name, value);
+    return true;
+}
+
+static const char *upsd_config_chart_get(struct config *cfg, const char *section, const char *name, const char *value) {
+    const char *s = inicfg_get(cfg, section, name, NULL);
+    return s ? strdupz(s) : value;
+}
+
+// Takes the options of the [chart <name>] section, if there is one, into a chart.
+static void upsd_config_chart(struct config *cfg, const char *name, struct nd_chart *chart) {
+    char section[2 * BUFLEN];
+
+    snprintfz(section, sizeof(section), "chart %s", name);
+    chart->chart_id        = upsd_config_chart_get(cfg, section, "id", chart->chart_id);
+    chart->chart_title     = upsd_config_chart_get(cfg, section, "title", chart->chart_title);
+    chart->chart_units     = upsd_config_chart_get(cfg, section, "units", chart->chart_units);
+    chart->chart_family    = upsd_config_chart_get(cfg, section, "family", chart->chart_family);
+    chart->chart_context   = upsd_config_chart_get(cfg, section, "context", chart->chart_context);
+    chart->chart_type      = upsd_config_chart_get(cfg, section, "type", chart->chart_type);
+    chart->chart_dimension = upsd_config_chart_get(cfg, section, "dimension", chart->chart_dimension);
+    chart->chart_priority  = inicfg_get_number(cfg, section, "priority", chart->chart_priority);
+    chart->is_static       = inicfg_get_boolean(cfg, section, "static", chart->is_static);
+}
+
+// Maps a range of NUT variables to the chart of a template, as given by a line of the
+// [charts] section. The built-in templates are expanded already, so mapping one of them
+// to 'no' stops charting its members; the others are expanded here.
+static bool upsd_config_template(struct config *cfg, const char *pattern, const char *value) {
+    struct nd_chart *tmpl = NULL;
+
+    for (size_t i = 0; !tmpl && nd_chart_templates[i].nut_variable; i++)
+        if (streq(pattern, nd_chart_templates[i].nut_variable))
+            tmpl = &nd_chart_templates[i];
+
+    if (!inicfg_test_boolean_value(value)) {
+        for (size_t index = NUT_VAR_CHARTS; tmpl && index < nut_vars_used; index++)
+            if (nut_charts[index] && nut_charts[index]->group == tmpl)
+                nut_charts[index] = NULL;
+        return true;
+    }
+
+    if (!tmpl) {
+        if (!(tmpl = nut_chart_template_create(pattern, nut_vars_used))) {
+            netdata_log_error("NUT variable range '%s' of upsd.conf is not like '<name>{<first>..<last>}<name>'", pattern);
+            return false;
+        }
+        upsd_config_chart(cfg, pattern, tmpl);
+
+        // The variables of a range which overlaps a built-in one would get two charts.
+        for (size_t i = 0; nd_chart_templates[i].nut_variable; i++) {
+            if (streq(tmpl->chart_id, nd_chart_templates[i].chart_id)) {
+                netdata_log_error("NUT variable range '%s' of upsd.conf has the chart id '%s' of the built-in range '%s'",
+                                  pattern, tmpl->chart_id, nd_chart_templates[i].nut_variable);
+                return false;
+            }
+        }
+
+        return nut_chart_template_expand(tmpl);
+    }
+
+    upsd_config_chart(cfg, pattern, tmpl);
+    return true;
+}
+
+// Maps a NUT variable to a chart, as given by a line of the [charts] section. A variable
+// which is mapped to 'no' is not charted at all, even if it is built-in or discovered.
+static bool upsd_config_charts_cb(void *data, const char *name, const char *value) {
+    struct config *cfg = data;
+    size_t index = (size_t)dictionary_get(nd_nut_vars, name);
+    struct nd_chart *chart;
+
+    if (strchr(name, '{'))
+        return upsd_config_template(cfg, name, value);
+
+    if (index && index - 1 < NUT_VAR_CHARTS) {
+        netdata_log_error("NUT variable '%s' of upsd.conf cannot be charted on its own", name);
+        return false;
+    }
+
+    if (!inicfg_test_boolean_value(value)) {
+        if (index)
+            nut_charts[index - 1] = NULL;
+        else if (!nut_vars_index_full(name))
+            nut_vars_index_add(strdupz(name), NULL);
+        return true;
+    }
+
+    // The members of a template keep to its chart, since they have to be consecutive.
+    if (index && nut_charts[index - 1] && nut_charts[index - 1]->group) {
+        netdata_log_error("NUT variable '%s' of upsd.conf is charted by the template '%s'", name, nut_charts[index - 1]->group->nut_variable);
+        return false;
+    }
+
+    if (index)
+        chart = nut_charts[index - 1];
+    else if (nut_vars_index_full(name))
+        return false;
+    else {
+        chart = nut_chart_create(name, nut_vars_used);
+        nut_vars_index_add(chart->nut_variable, chart);
+    }
+
+    upsd_config_chart(cfg, name, chart);
+    return true;
+}
+
+// upsd.conf is like so, with one upsd server per line of the [servers] section, and one
+// NUT variable per line of the [charts] section:
+//
+//   [global]
+//       static variables update every = <duration>
+//       steady state update every = <duration>
+//       max fast UPSes = <number>
+//       autodiscovery = yes | no
+//       restart every = <duration>
+//       starttls = yes | no
+//       tls verify certificate = yes | no
+//       tls ca file = <path>
+//       tls ca path = <directory>
+//       keepalive every = <duration>
+//
+//   [servers]
+//       <name> = <host>[:<port>]
+//
+//   [charts]
+//       <nut variable> = yes | no
+//       <nut variable>{<first>..<last>}<nut variable> = yes | no
+//
+//   [chart <nut variable>]
+//       id = <chart id>
+//       title = <chart title>
+//       units = <chart units>
+//       family = <chart family>
+//       context = <chart context>
+//       type = line | area | stacked
+//       priority = <chart priority>
+//       dimension = <dimension id>
+//       static = yes | no
+//
+// The options of a [chart] section default to those of the built-in chart of the variable,
+// if there is one, or to ones derived from the name of the variable. The section of a range
+// of variables describes the one chart of the range, whose dimensions are named after the
+// variables, so its 'dimension' option is not used.
+//
+// If no server is configured, then the local upsd server is collected, as before.
+static void upsd_config_load(void) {
+    struct config cfg = APPCONFIG_INITIALIZER;
+    char *filename;
+
+    filename = filename_from_path_entry_strdupz(user_config_dir, UPSD_CONFIG_FILENAME);
+    if (!inicfg_load(&cfg, filename, 0, NULL)) {
+        freez(filename);
+        filename = filename_from_path_entry_strdupz(stock_config_dir, UPSD_CONFIG_FILENAME);
+        inicfg_load(&cfg, filename, 0, NULL);
+    }
+    freez(filename);
+
+    static_update_every = inicfg_get_duration_seconds(&cfg, "global", "static variables update every", static_update_every);
+    if (static_update_every < (time_t)netdata_update_every)
+        static_update_every = netdata_update_every;
+    if (static_update_every % netdata_update_every)
+        static_update_every += netdata_update_every - static_update_every % netdata_update_every;
+
+    steady_update_every = inicfg_get_duration_seconds(&cfg, "global", "steady state update every", netdata_update_every);
+    if (steady_update_every < (time_t)netdata_update_every)
+        steady_update_every = netdata_update_every;
+    if (steady_update_every % netdata_update_every)
+        steady_update_every += netdata_update_every - steady_update_every % netdata_update_every;
+
+    fast_ups_max = inicfg_get_number_range(&cfg, "global", "max fast UPSes", fast_ups_max, 0, 4096);
+
+    // The samples divide the tick evenly, so that the last one is taken a step before the
+    // heartbeat of the next tick.
+    msec_t update_every_ms = netdata_update_every * MSEC_PER_SEC;
+    msec_t sample_every_ms = inicfg_get_duration_ms(&cfg, "global", "sample every", update_every_ms);
+    if (sample_every_ms < UPSD_SAMPLE_MIN_MS)
+        sample_every_ms = UPSD_SAMPLE_MIN_MS;
+    samples_per_tick = sample_every_ms < update_every_ms ? update_every_ms / sample_every_ms : 1;
+    sample_every_ut = netdata_update_every * USEC_PER_SEC / samples_per_tick;
+
+    int64_t decimal_digits = inicfg_get_number_range(&cfg, "global", "decimal digits", 2, 0, NETDATA_PLUGIN_DECIMAL_DIGITS_MAX);
+    for (value_precision = 1; decimal_digits > 0; decimal_digits--)
+        value_precision *= 10;
+
+    nut_vars_autodiscovery = inicfg_get_boolean(&cfg, "global", "autodiscovery", nut_vars_autodiscovery);
+    self_telemetry = inicfg_get_boolean(&cfg, "global", "self telemetry", self_telemetry);
+    virtual_nodes = inicfg_get_boolean(&cfg, "global", "virtual nodes", virtual_nodes);
+
+    // A replay takes precedence over a recording, since it does not connect to upsd.
+    const char *directory;
+    if ((directory = inicfg_get(&cfg, "global", "replay directory", NULL))) {
+        nut_capture_mode = NUT_CAPTURE_REPLAY;
+        nut_capture_directory = strdupz(directory);
+        nut_capture_realtime = strcmp(inicfg_get(&cfg, "global", "replay speed", "full"), "real time") == 0;
+    }
+    else if ((directory = inicfg_get(&cfg, "global", "record directory", NULL))) {
+        nut_capture_mode = NUT_CAPTURE_RECORD;
+        nut_capture_directory = strdupz(directory);
+    }
+    restart_every = inicfg_get_duration_seconds(&cfg, "global", "restart every", restart_every);
+    if (restart_every < 0)
+        restart_every = 0;
+
+    // The certificate of upsd is verified against the default CAs of the system, unless a
+    // file or a directory of CAs is given.
+    const char *ca;
+    nut_client_starttls = inicfg_get_boolean(&cfg, "global", "starttls", nut_client_starttls);
+    nut_client_tls_verify = inicfg_get_boolean(&cfg, "global", "tls verify certificate", nut_client_tls_verify);
+    if ((ca = inicfg_get(&cfg, "global", "tls ca file", NULL)))
+        nut_client_tls_ca_file = strdupz(ca);
+    if ((ca = inicfg_get(&cfg, "global", "tls ca path", NULL)))
+        nut_client_tls_ca_path = strdupz(ca);
+
+    nut_client_keepalive = inicfg_get_duration_seconds(&cfg, "global", "keepalive every", nut_client_keepalive);
+    if (nut_client_keepalive < 0)
+        nut_client_keepalive = 0;
+
+    inicfg_foreach_value_in_section(&cfg, "servers", upsd_servers_add_cb, NULL);
+    inicfg_foreach_value_in_section(&cfg, "charts", upsd_config_charts_cb, &cfg);
+    inicfg_free(&cfg);
+
+    if (!upsd_servers)
+        upsd_server_add(NULL, UPSD_DEFAULT_HOST);
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+    struct upsd_server *srv, *next;
+
+    parse_command_line(argc, argv);
+
+    nd_log_initialize_for_external_plugins(PLUGIN_UPSD_NAME);
+    netdata_threads_init_for_external_plugins(0);
+
+    user_config_dir = getenv("NETDATA_USER_CONFIG_DIR");
+    if (user_config_dir == NULL)
+        user_config_dir = CONFIG_DIR;
+
+    stock_config_dir = getenv("NETDATA_STOCK_CONFIG_DIR");
+    if (stock_config_dir == NULL)
+        stock_config_dir = LIBCONFIG_DIR;
+
+    nut_vars_index_init();
+    upsd_config_load();
+    if (nut_client_starttls && !nut_client_tls_init())
+        return NETDATA_PLUGIN_EXIT_AND_DISABLE;
+    if (self_telemetry)
+        workers_utilization_enable();
+
+    // Set stdout to block-buffered, to make fwrite() faster.
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
+    plugin_started_s = now_monotonic_sec();
+
+    struct functions_evloop_globals *wg = upsd_functions_init();
+
+    for (srv = upsd_servers; srv; srv = srv->next) {
+        char tag[NETDATA_THREAD_TAG_MAX + 1];
+        snprintfz(tag, sizeof(tag), "UPSD[%s]", srv->name ? srv->name : srv->host);
+        srv->thread = nd_thread_create(tag, NETDATA_THREAD_OPTION_DONT_LOG, upsd_server_thread, srv);
+    }
+
+    ND_THREAD *telemetry = self_telemetry ?
+        nd_thread_create("UPSD_TELEMETRY", NETDATA_THREAD_OPTION_DONT_LOG, upsd_telemetry_thread, NULL) : NULL;
+
+    // Netdata should restart the plugin, unless it went away.
+    rc = NETDATA_PLUGIN_EXIT_AND_DISABLE;
+    for (srv = upsd_servers; srv; srv = next) {
+        next = srv->next;
+        nd_thread_join(srv->thread);
+        if (srv->exit_code == NETDATA_PLUGIN_EXIT_AND_RESTART)
+            rc = NETDATA_PLUGIN_EXIT_AND_RESTART;
+        netdata_mutex_lock(&upsd_servers_mutex);
+        DOUBLE_LINKED_LIST_REMOVE_ITEM_UNSAFE(upsd_servers, srv, prev, next);
+        netdata_mutex_unlock(&upsd_servers_mutex);
+        upsd_server_free(srv);
+    }
+
+    if (telemetry) {
+        nd_thread_signal_cancel(telemetry);
+        nd_thread_join(telemetry);
+    }
 
-    upscli_disconnect(&ups1);
-    upscli_disconnect(&ups2);
-    upscli_cleanup();
+    functions_evloop_cancel_threads(wg);
+    dictionary_destroy(nd_nut_vars);
+    freez(chart_slots.released);
+    if (nut_client_tls_ctx)
+        SSL_CTX_free(nut_client_tls_ctx);
 
-    return NETDATA_PLUGIN_EXIT_AND_RESTART;
+    return rc;
 }